@@ -0,0 +1,285 @@
+/*
+ * nginx-dogstatsd module
+ * Copyright (C) 2017 Matt Robenolt
+ *
+ * Sends the datagrams of a "dogstatsd_server file:" capture to a DogStatsD
+ * server, at the pace they were captured or faster.
+ *
+ *     cc -O2 -o dogstatsd-replay contrib/dogstatsd-replay.c
+ *     dogstatsd-replay [-s speed] [-a host[:port]] capture
+ *
+ * A speed of 2 replays twice as fast, 0 sends everything without waiting.
+ * An IPv6 address with a port is written in brackets, [::1]:8125.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+
+/* see ngx_dogstatsd.h */
+#define STATSD_MAX_STR            1472
+#define STATSD_RING_MAGIC         "DSDRING1"
+#define STATSD_RING_RECORD_MAGIC  0xfffed5d5
+#define STATSD_RING_ALIGNMENT     16
+
+typedef struct {
+    unsigned char   magic[8];
+    uint64_t        size;
+    uint64_t        pos;
+    unsigned char   reserved[40];
+} ring_t;
+
+typedef struct {
+    uint32_t        magic;
+    uint32_t        len;
+    uint64_t        usec;
+} record_t;
+
+
+static uint64_t
+now_usec(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void
+sleep_usec(uint64_t usec)
+{
+    struct timespec  ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        /* void */
+    }
+}
+
+
+static int
+connect_to(char *addr)
+{
+    int               s, rc;
+    char             *host, *port;
+    struct addrinfo   hints, *res;
+
+    host = addr;
+    port = NULL;
+
+    if (*addr == '[') {
+        /* [::1]:8125 */
+        host = addr + 1;
+        port = strchr(host, ']');
+
+        if (port == NULL || (port[1] != '\0' && port[1] != ':')) {
+            fprintf(stderr, "%s: invalid address\n", addr);
+            return -1;
+        }
+
+        *port++ = '\0';
+        port = (*port == ':') ? port + 1 : NULL;
+
+    } else if (strchr(addr, ':') == strrchr(addr, ':')) {
+        /* host:8125, an IPv6 address without brackets has no port */
+        port = strchr(addr, ':');
+
+        if (port) {
+            *port++ = '\0';
+        }
+    }
+
+    if (port == NULL || *port == '\0') {
+        port = "8125";
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+        return -1;
+    }
+
+    s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+    if (s == -1 || connect(s, res->ai_addr, res->ai_addrlen) == -1) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, strerror(errno));
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    freeaddrinfo(res);
+
+    return s;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int              fd, s, c;
+    char            *addr;
+    double           speed;
+    size_t           n, first, part;
+    uint32_t         magic, len;
+    uint64_t         size, pos, start, p, base, t0, delay, now, usec;
+    ring_t          *ring;
+    record_t        *rec;
+    struct stat      st;
+    unsigned char   *data, buf[STATSD_MAX_STR];
+    unsigned long    sent, skipped;
+
+    addr = "127.0.0.1";
+    speed = 1;
+
+    while ((c = getopt(argc, argv, "a:s:")) != -1) {
+        switch (c) {
+        case 'a':
+            addr = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || speed < 0) {
+        goto usage;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if ((size_t) st.st_size < sizeof(ring_t)) {
+        fprintf(stderr, "%s: not a capture\n", argv[optind]);
+        return 1;
+    }
+
+    ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    size = ring->size;
+
+    if (memcmp(ring->magic, STATSD_RING_MAGIC, sizeof(ring->magic)) != 0
+        || size == 0 || size % STATSD_RING_ALIGNMENT
+        || (uint64_t) st.st_size != sizeof(ring_t) + size)
+    {
+        fprintf(stderr, "%s: not a capture\n", argv[optind]);
+        return 1;
+    }
+
+    s = connect_to(addr);
+    if (s == -1) {
+        return 1;
+    }
+
+    data = (unsigned char *) ring + sizeof(ring_t);
+
+    /* nginx may still be writing, replay what was there when we started */
+    pos = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+    start = pos > size ? pos - size : 0;
+
+    sent = 0;
+    skipped = 0;
+    base = 0;
+    t0 = now_usec();
+
+    for (p = start; p + sizeof(record_t) <= pos; /* void */) {
+        rec = (record_t *) (data + p % size);
+
+        magic = __atomic_load_n(&rec->magic, __ATOMIC_ACQUIRE);
+        len = rec->len;
+        usec = rec->usec;
+
+        n = (sizeof(record_t) + len + STATSD_RING_ALIGNMENT - 1)
+            & ~(STATSD_RING_ALIGNMENT - 1);
+
+        /* the oldest record may be partly overwritten, the newest unfinished */
+
+        if (magic != STATSD_RING_RECORD_MAGIC || len > STATSD_MAX_STR
+            || p + n > pos)
+        {
+            p += STATSD_RING_ALIGNMENT;
+            skipped++;
+            continue;
+        }
+
+        first = (p + sizeof(record_t)) % size;
+        part = len < size - first ? len : size - first;
+
+        memcpy(buf, data + first, part);
+        memcpy(buf + part, data, len - part);
+
+        /*
+         * nginx may have wrapped around and written over the record while
+         * it was copied, it clears the magic before writing a record
+         */
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (rec->magic != magic || rec->len != len
+            || __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE) > p + size)
+        {
+            p += n;
+            skipped++;
+            continue;
+        }
+
+        if (base == 0) {
+            base = usec;
+        }
+
+        if (speed > 0 && usec > base) {
+            delay = (uint64_t) ((usec - base) / speed);
+
+            now = now_usec();
+
+            if (t0 + delay > now) {
+                sleep_usec(t0 + delay - now);
+            }
+        }
+
+        if (send(s, buf, len, 0) == -1) {
+            fprintf(stderr, "send(): %s\n", strerror(errno));
+        }
+
+        sent++;
+        p += n;
+    }
+
+    fprintf(stderr, "%lu datagrams sent, %lu blocks skipped\n", sent, skipped);
+
+    return 0;
+
+usage:
+
+    fprintf(stderr, "usage: %s [-s speed] [-a host[:port]] capture\n", argv[0]);
+
+    return 1;
+}
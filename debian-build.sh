@@ -12,3 +12,8 @@ cd nginx-*/
 make modules
 
 mv objs/ngx_http_dogstatsd_module.so /opt/nginx-dogstatsd/
+
+# built when nginx is configured with the stream module
+if [ -f objs/ngx_stream_dogstatsd_module.so ]; then
+    mv objs/ngx_stream_dogstatsd_module.so /opt/nginx-dogstatsd/
+fi
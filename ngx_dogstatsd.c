@@ -0,0 +1,838 @@
+/*
+ * nginx-dogstatsd module
+ * Copyright (C) 2017 Matt Robenolt
+ *
+ * nginx-statsd module
+ * Copyright (C) 2012 Zebrafish Labs Inc.
+ *
+ * Much of this source code was derived from nginx-udplog-module which
+ * has the following copyright. Please refer to the LICENSE file for
+ * details.
+ *
+ * Copyright (C) 2010 Valery Kholodkov
+*/
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <stdlib.h>  /* for getenv() */
+
+#include "ngx_dogstatsd.h"
+
+
+static void ngx_dogstatsd_updater_cleanup(void *data);
+static void ngx_dogstatsd_udp_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_dogstatsd_udp_connect(ngx_resolver_connection_t *rec);
+static ngx_int_t ngx_dogstatsd_ring_open(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint);
+static ngx_err_t ngx_dogstatsd_ring_reserve(ngx_fd_t fd, size_t size);
+static void ngx_dogstatsd_ring_cleanup(void *data);
+static ngx_int_t ngx_dogstatsd_ring_write(ngx_udp_endpoint_t *l, u_char *buf, size_t len);
+
+
+ngx_dogstatsd_stats_t  ngx_dogstatsd_stats;
+
+
+ngx_int_t
+ngx_dogstatsd_init_endpoint(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint)
+{
+    ngx_pool_cleanup_t    *cln;
+    ngx_resolver_connection_t  *rec;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, cf->log, 0,
+			   "dogstatsd: initting endpoint");
+
+    if (endpoint->file.len) {
+        endpoint->log = &cf->cycle->new_log;
+        return ngx_dogstatsd_ring_open(cf, endpoint);
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if(cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_dogstatsd_updater_cleanup;
+    cln->data = endpoint;
+
+    rec = ngx_calloc(sizeof(ngx_resolver_connection_t), cf->log);
+    if (rec == NULL) {
+        return NGX_ERROR;
+    }
+
+    endpoint->udp_connection = rec;
+
+    rec->sockaddr = endpoint->peer_addr.sockaddr;
+    rec->socklen = endpoint->peer_addr.socklen;
+    rec->server = endpoint->peer_addr.name;
+
+    endpoint->log = &cf->cycle->new_log;
+
+    return NGX_OK;
+}
+
+static void
+ngx_dogstatsd_updater_cleanup(void *data)
+{
+    ngx_udp_endpoint_t  *e = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "cleanup dogstatsd_updater");
+
+    if(e->udp_connection) {
+        if(e->udp_connection->udp) {
+            ngx_close_connection(e->udp_connection->udp);
+        }
+
+        ngx_free(e->udp_connection);
+    }
+}
+
+static void ngx_dogstatsd_udp_dummy_handler(ngx_event_t *ev)
+{
+}
+
+static ngx_int_t
+ngx_dogstatsd_udp_connect(ngx_resolver_connection_t *rec)
+{
+    int                rc;
+    ngx_int_t          event;
+    ngx_event_t       *rev, *wev;
+    ngx_socket_t       s;
+    ngx_connection_t  *c;
+
+    s = ngx_socket(rec->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, &rec->log, 0, "UDP socket %d", s);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(s, &rec->log);
+
+    if (c == NULL) {
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
+                          ngx_close_socket_n "failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+
+        goto failed;
+    }
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->log = &rec->log;
+    wev->log = &rec->log;
+
+    rec->udp = c;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, &rec->log, 0,
+                   "connect to %V, fd:%d #%uA", &rec->server, s, c->number);
+
+    rc = connect(s, rec->sockaddr, rec->socklen);
+
+    /* TODO: iocp */
+
+    if (rc == -1) {
+        ngx_log_error(NGX_LOG_CRIT, &rec->log, ngx_socket_errno,
+                      "connect() failed");
+
+        goto failed;
+    }
+
+    /* UDP sockets are always ready to write */
+    wev->ready = 1;
+
+    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
+                /* kqueue, epoll */                 NGX_CLEAR_EVENT:
+                /* select, poll, /dev/poll */       NGX_LEVEL_EVENT;
+                /* eventport event type has no meaning: oneshot only */
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_connection(c);
+    rec->udp = NULL;
+
+    return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_dogstatsd_udp_send(ngx_udp_endpoint_t *l, u_char *buf, size_t len)
+{
+    ssize_t                n;
+    ngx_resolver_connection_t  *rec;
+
+    if (l->ring) {
+        return ngx_dogstatsd_ring_write(l, buf, len);
+    }
+
+    rec = l->udp_connection;
+    if (rec->udp == NULL) {
+
+        rec->log = *l->log;
+        rec->log.handler = NULL;
+        rec->log.data = NULL;
+        rec->log.action = "logging";
+
+        if(ngx_dogstatsd_udp_connect(rec) != NGX_OK) {
+            if(rec->udp != NULL) {
+                ngx_free_connection(rec->udp);
+                rec->udp = NULL;
+            }
+
+            ngx_dogstatsd_stats.connect_errors++;
+            return NGX_ERROR;
+        }
+
+        rec->udp->data = l;
+        rec->udp->read->handler = ngx_dogstatsd_udp_dummy_handler;
+        rec->udp->read->resolver = 0;
+    }
+
+    n = ngx_send(rec->udp, buf, len);
+
+    if (n == NGX_AGAIN) {
+        ngx_dogstatsd_stats.send_errors++;
+        ngx_dogstatsd_stats.errors[STATSD_ERR_EAGAIN]++;
+        return NGX_ERROR;
+    }
+
+    if (n == -1) {
+        ngx_dogstatsd_stats.send_errors++;
+
+        switch (ngx_socket_errno) {
+        case ECONNREFUSED:
+            ngx_dogstatsd_stats.errors[STATSD_ERR_ECONNREFUSED]++;
+            break;
+        case EMSGSIZE:
+            ngx_dogstatsd_stats.errors[STATSD_ERR_EMSGSIZE]++;
+            break;
+        case ENOBUFS:
+            ngx_dogstatsd_stats.errors[STATSD_ERR_ENOBUFS]++;
+            break;
+        default:
+            ngx_dogstatsd_stats.errors[STATSD_ERR_OTHER]++;
+        }
+
+        return NGX_ERROR;
+    }
+
+    if ((size_t) n != (size_t) len) {
+#if defined nginx_version && nginx_version >= 8032
+        ngx_log_error(NGX_LOG_CRIT, &rec->log, 0, "send() incomplete");
+#else
+        ngx_log_error(NGX_LOG_CRIT, rec->log, 0, "send() incomplete");
+#endif
+        ngx_dogstatsd_stats.send_errors++;
+        ngx_dogstatsd_stats.errors[STATSD_ERR_INCOMPLETE]++;
+        return NGX_ERROR;
+    }
+
+    ngx_dogstatsd_stats.datagrams++;
+    ngx_dogstatsd_stats.bytes += len;
+
+    return NGX_OK;
+}
+
+void
+ngx_dogstatsd_buffer_line(ngx_udp_endpoint_t *l, u_char *line, size_t len)
+{
+    if (l->len > 0 && l->len + 1 + len > STATSD_MAX_STR) {
+        ngx_dogstatsd_buffer_flush(l);
+    }
+
+    if (l->len > 0) {
+        l->buf[l->len++] = '\n';
+    }
+
+    ngx_memcpy(l->buf + l->len, line, len);
+    l->len += len;
+
+    ngx_dogstatsd_stats.lines++;
+}
+
+void
+ngx_dogstatsd_buffer_flush(ngx_udp_endpoint_t *l)
+{
+    if (l->len == 0) {
+        return;
+    }
+
+    ngx_dogstatsd_udp_send(l, l->buf, l->len);
+    l->len = 0;
+}
+
+/*
+ * Parses "file:path" and "size=size" of dogstatsd_server.
+ */
+char *
+ngx_dogstatsd_set_file(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint, ngx_str_t *value,
+    ngx_str_t *size)
+{
+    ssize_t    n;
+    ngx_str_t  s;
+
+#if (NGX_PTR_SIZE != 8)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "capture files require 64-bit atomic operations");
+    return NGX_CONF_ERROR;
+#endif
+
+    endpoint->file.len = value->len - (sizeof("file:") - 1);
+    endpoint->file.data = value->data + (sizeof("file:") - 1);
+
+    if (endpoint->file.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty file name in \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &endpoint->file, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    endpoint->file_size = STATSD_RING_DEFAULT_SIZE;
+
+    if (size == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    if (size->len <= sizeof("size=") - 1
+        || ngx_strncmp(size->data, "size=", sizeof("size=") - 1) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", size);
+        return NGX_CONF_ERROR;
+    }
+
+    s.len = size->len - (sizeof("size=") - 1);
+    s.data = size->data + (sizeof("size=") - 1);
+
+    n = ngx_parse_size(&s);
+
+    if (n == NGX_ERROR || n < STATSD_RING_MIN_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid size \"%V\", it must be at least 64k", size);
+        return NGX_CONF_ERROR;
+    }
+
+    endpoint->file_size = (size_t) n & ~(STATSD_RING_ALIGNMENT - 1);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Allocates the blocks of a new capture: a worker writing to a hole of the
+ * mapping that the file system can not fill would be killed by SIGBUS.
+ */
+
+#if (NGX_HAVE_POSIX_FALLOCATE)
+
+#define ngx_dogstatsd_ring_reserve_n  "posix_fallocate()"
+
+static ngx_err_t
+ngx_dogstatsd_ring_reserve(ngx_fd_t fd, size_t size)
+{
+    return posix_fallocate(fd, 0, size);
+}
+
+#else
+
+#define ngx_dogstatsd_ring_reserve_n  "pwrite()"
+
+static ngx_err_t
+ngx_dogstatsd_ring_reserve(ngx_fd_t fd, size_t size)
+{
+    u_char   zero[4096];
+    off_t    offset;
+    size_t   len;
+    ssize_t  n;
+
+    ngx_memzero(zero, sizeof(zero));
+
+    for (offset = 0; (size_t) offset < size; offset += n) {
+        len = ngx_min(size - (size_t) offset, sizeof(zero));
+
+        n = pwrite(fd, zero, len, offset);
+
+        if (n == -1) {
+            return ngx_errno;
+        }
+
+        if (n == 0) {
+            return NGX_ENOSPC;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+/*
+ * The file is mapped by the master process and shared by the workers.  An
+ * existing capture is kept, as old workers may still write to it after a
+ * reload, and is never resized under them.
+ */
+static ngx_int_t
+ngx_dogstatsd_ring_open(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint)
+{
+    size_t                 total;
+    u_char                *addr;
+    ngx_fd_t               fd;
+    ngx_err_t              err;
+    ngx_file_info_t        fi;
+    ngx_pool_cleanup_t    *cln;
+    ngx_dogstatsd_ring_t  *ring;
+
+    total = sizeof(ngx_dogstatsd_ring_t) + endpoint->file_size;
+
+    fd = ngx_open_file(endpoint->file.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &endpoint->file);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &endpoint->file);
+        goto failed;
+    }
+
+    if (ngx_file_size(&fi) == 0) {
+        err = ngx_dogstatsd_ring_reserve(fd, total);
+
+        if (err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, err,
+                               ngx_dogstatsd_ring_reserve_n " \"%V\" failed",
+                               &endpoint->file);
+
+            /* let the next start try again */
+            if (ftruncate(fd, 0) == -1) {
+                ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                                   "ftruncate() \"%V\" failed", &endpoint->file);
+            }
+
+            goto failed;
+        }
+    }
+
+    if (ngx_file_size(&fi) != 0 && (size_t) ngx_file_size(&fi) != total) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" is not a capture of %uz bytes, remove it first",
+                           &endpoint->file, endpoint->file_size);
+        goto failed;
+    }
+
+    addr = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "mmap(%uz) \"%V\" failed", total, &endpoint->file);
+        goto failed;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &endpoint->file);
+    }
+
+    ring = (ngx_dogstatsd_ring_t *) addr;
+
+    if (ngx_file_size(&fi) == 0) {
+        ngx_memcpy(ring->magic, STATSD_RING_MAGIC, sizeof(ring->magic));
+        ring->size = endpoint->file_size;
+
+    } else if (ngx_memcmp(ring->magic, STATSD_RING_MAGIC, sizeof(ring->magic)) != 0
+               || ring->size != endpoint->file_size)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" is not a capture of %uz bytes, remove it first",
+                           &endpoint->file, endpoint->file_size);
+        munmap(addr, total);
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        munmap(addr, total);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_dogstatsd_ring_cleanup;
+    cln->data = endpoint;
+
+    endpoint->ring = ring;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &endpoint->file);
+    }
+
+    return NGX_ERROR;
+}
+
+static void
+ngx_dogstatsd_ring_cleanup(void *data)
+{
+    ngx_udp_endpoint_t  *e = data;
+
+    if (e->ring) {
+        munmap((void *) e->ring, sizeof(ngx_dogstatsd_ring_t) + e->file_size);
+        e->ring = NULL;
+    }
+}
+
+/*
+ * Workers reserve the space of a record by moving the position of the
+ * ring, then write it.  The magic of the record is written last, so that
+ * a reader skips records being written or overwritten.
+ */
+static ngx_int_t
+ngx_dogstatsd_ring_write(ngx_udp_endpoint_t *l, u_char *buf, size_t len)
+{
+    u_char                  *data;
+    size_t                   n;
+    uint64_t                 pos, size, p;
+    struct timeval           tv;
+    ngx_dogstatsd_ring_t    *ring;
+    ngx_dogstatsd_record_t  *rec;
+
+    ring = l->ring;
+    size = ring->size;
+    data = (u_char *) ring + sizeof(ngx_dogstatsd_ring_t);
+
+    n = ngx_align(sizeof(ngx_dogstatsd_record_t) + len, STATSD_RING_ALIGNMENT);
+
+    pos = ngx_atomic_fetch_add((ngx_atomic_t *) &ring->pos, n);
+
+    rec = (ngx_dogstatsd_record_t *) (data + pos % size);
+
+    rec->magic = 0;
+    ngx_memory_barrier();
+
+    /* records are aligned, only the datagram may wrap around the end */
+
+    p = (pos + sizeof(ngx_dogstatsd_record_t)) % size;
+    n = ngx_min(len, size - p);
+
+    ngx_memcpy(data + p, buf, n);
+    ngx_memcpy(data, buf + n, len - n);
+
+    ngx_gettimeofday(&tv);
+
+    rec->len = (uint32_t) len;
+    rec->usec = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+    ngx_memory_barrier();
+    rec->magic = STATSD_RING_RECORD_MAGIC;
+
+    ngx_dogstatsd_stats.datagrams++;
+    ngx_dogstatsd_stats.bytes += len;
+
+    return NGX_OK;
+}
+
+ngx_str_t *
+ngx_dogstatsd_get_env_value(ngx_conf_t *cf, ngx_str_t *value)
+{
+    char        *env_value;
+    size_t      env_len;
+    u_char      *p;
+    char        *env_name;
+
+    if (!(value->len > 1 && value->data[0] == '$')) {
+        return value;
+    }
+
+    /* Create a null-terminated string for getenv() */
+    env_name = ngx_palloc(cf->pool, value->len);
+    if (env_name == NULL) {
+        return NULL;
+    }
+    ngx_memcpy(env_name, value->data + 1, value->len - 1);
+    env_name[value->len - 1] = '\0';
+
+    env_value = getenv(env_name);
+    if (env_value == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "environment variable \"%V\" not found", value);
+        return NULL;
+    }
+    env_len = strlen(env_value);
+    if (env_len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "environment variable \"%V\" is empty", value);
+        return NULL;
+    }
+
+    /* Allocate memory and copy the environment variable value including null terminator */
+    p = ngx_palloc(cf->pool, env_len + 1);
+    if (p == NULL) {
+        return NULL;
+    }
+    ngx_memcpy(p, env_value, env_len);
+    p[env_len] = '\0';
+    value->data = p;
+    value->len = env_len;
+
+    return value;
+}
+
+/*
+ * Parses the numbers of nginx variables, "12", "-3", "0.5" or "1.2345",
+ * into millionths.  With "seconds", a number with a fraction is a time in
+ * seconds, as $request_time "0.012", and is converted to milliseconds.
+ * The lists of $upstream_response_time, "0.010, 0.002 : 0.005", are
+ * summed and their "-" skipped.
+ *
+ * Returns STATSD_VALUE_INVALID if there is no number.
+ */
+int64_t
+ngx_dogstatsd_metric_value(ngx_str_t *value, ngx_uint_t seconds)
+{
+    u_char      *p, *last;
+    int64_t      sum, n, f;
+    ngx_uint_t   d, neg, dot, digits, decimals, scale, found;
+
+    static const int64_t  pow10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000
+    };
+
+    p = value->data;
+    last = p + value->len;
+
+    sum = 0;
+    found = 0;
+
+    for ( ;; ) {
+
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        neg = (p < last && *p == '-');
+        p += neg;
+
+        n = 0;
+
+        for (digits = 0; p < last && (d = (ngx_uint_t) (*p - '0')) <= 9; digits++) {
+            n = n * 10 + d;
+            p++;
+
+            if (digits == 12) {
+                /* does not fit in millionths of seconds or milliseconds */
+                return STATSD_VALUE_INVALID;
+            }
+        }
+
+        dot = (p < last && *p == '.');
+        p += dot;
+
+        /* decimals past the precision of the scale are truncated */
+
+        f = 0;
+
+        for (decimals = 0; p < last && (d = (ngx_uint_t) (*p - '0')) <= 9; p++) {
+            if (decimals < 9) {
+                f = f * 10 + d;
+                decimals++;
+            }
+        }
+
+        scale = (seconds && dot) ? 9 : 6;
+
+        if (digits + decimals == 0) {
+            if (!neg || dot) {
+                return STATSD_VALUE_INVALID;
+            }
+
+            /* an upstream without a time */
+
+        } else if (digits > 18 - scale) {
+            return STATSD_VALUE_INVALID;
+
+        } else {
+            f = (decimals > scale) ? f / pow10[decimals - scale]
+                                   : f * pow10[scale - decimals];
+            n = n * pow10[scale] + f;
+
+            sum += neg ? -n : n;
+            found = 1;
+        }
+
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        if (p == last) {
+            break;
+        }
+
+        if (*p != ',' && *p != ':') {
+            return STATSD_VALUE_INVALID;
+        }
+
+        p++;
+    }
+
+    return found ? sum : STATSD_VALUE_INVALID;
+}
+
+/*
+ * Prints a value in millionths as a decimal number without trailing zeros
+ * into "buf" of STATSD_VALUE_LEN bytes.
+ */
+u_char *
+ngx_dogstatsd_format_value(u_char *buf, int64_t value)
+{
+    u_char      *p;
+    uint64_t     v;
+    ngx_uint_t   frac;
+
+    p = buf;
+
+    if (value < 0) {
+        *p++ = '-';
+        v = (uint64_t) -(value + 1) + 1;
+
+    } else {
+        v = (uint64_t) value;
+    }
+
+    p = ngx_sprintf(p, "%uL", v / STATSD_VALUE_SCALE);
+
+    frac = (ngx_uint_t) (v % STATSD_VALUE_SCALE);
+    if (frac == 0) {
+        return p;
+    }
+
+    p = ngx_sprintf(p, ".%06ui", frac);
+
+    while (p[-1] == '0') {
+        p--;
+    }
+
+    return p;
+}
+
+/*
+ * Formats "<key><suffix>:<value>|<type>|@<rate>|#<tags>" into "line" of
+ * STATSD_MAX_STR bytes.  "rate" is in 1/STATSD_RATE_SCALE, "suffix" may
+ * be NULL.
+ */
+u_char *
+ngx_dogstatsd_format_line(u_char *line, ngx_str_t *key, ngx_str_t *suffix,
+    int64_t value, const char *type, ngx_uint_t rate, ngx_str_t *tags)
+{
+    u_char  *p, *last, num[STATSD_VALUE_LEN];
+    size_t   len;
+
+    last = line + STATSD_MAX_STR;
+    len = ngx_dogstatsd_format_value(num, value) - num;
+
+    p = ngx_slprintf(line, last, "%V", key);
+
+    if (suffix) {
+        p = ngx_slprintf(p, last, "%V", suffix);
+    }
+
+    p = ngx_slprintf(p, last, ":%*s|%s", len, num, type);
+
+    // The agent does not extrapolate gauges, they go without a rate.
+    if (rate < STATSD_RATE_SCALE && ngx_strcmp(type, "g") != 0) {
+        p = ngx_slprintf(p, last, "|@0.%04ui", rate);
+    }
+
+    if (tags && tags->len) {
+        p = ngx_slprintf(p, last, "|#%V", tags);
+    }
+
+    if (p == last) {
+        ngx_dogstatsd_stats.truncated++;
+    }
+
+    return p;
+}
+
+uintptr_t
+ngx_escape_dogstatsd_key(u_char *dst, u_char *src, size_t size)
+{
+    ngx_uint_t      n;
+    uint32_t       *escape;
+
+                    /* " ", "#", """, "%", "'", %00-%1F, %7F-%FF */
+
+    static uint32_t   statsd_key[] = {
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+
+                    /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
+		0xfc00bfff, /* 1111 1100 0000 0000  1011 1111 1111 1111 */
+
+                    /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
+		0x78000001, /* 0111 1000 0000 0000  0000 0000 0000 0001 */
+
+                    /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
+		0xf8000001, /* 1111 1000 0000 0000  0000 0000 0000 0001 */
+
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff  /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+    };
+
+    static uint32_t  *map[] =
+        { statsd_key };
+
+
+    escape = map[0];
+
+    if (dst == NULL) {
+
+        /* find the number of the characters to be escaped */
+
+        n = 0;
+
+        while (size) {
+            if (escape[*src >> 5] & (1 << (*src & 0x1f))) {
+                n++;
+            }
+            src++;
+            size--;
+        }
+
+        return (uintptr_t) n;
+    }
+
+    while (size) {
+        if (escape[*src >> 5] & (1 << (*src & 0x1f))) {
+            *dst++ = '_';
+            src++;
+
+        } else {
+            *dst++ = *src++;
+        }
+        size--;
+    }
+
+    return (uintptr_t) dst;
+}
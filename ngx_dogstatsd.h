@@ -0,0 +1,157 @@
+/*
+ * nginx-dogstatsd module
+ * Copyright (C) 2017 Matt Robenolt
+ *
+ * Endpoints, sending and parsing shared by the http and stream modules.
+ */
+#ifndef _NGX_DOGSTATSD_H_INCLUDED_
+#define _NGX_DOGSTATSD_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <nginx.h>
+
+
+#define STATSD_DEFAULT_PORT 			8125
+
+/*
+ * Max StatsD message length = 1472
+ * - 1 ASCII character = 1 byte
+ * - 1 UDP packet payload = 1472 bytes ( 1500-20-8 )
+*/
+#define STATSD_MAX_STR 1472
+
+/*
+ * Values are fixed-point numbers in millionths, so that timings keep
+ * sub-millisecond digits.  STATSD_VALUE_LEN is the longest printed value.
+ */
+#define STATSD_VALUE_SCALE      1000000
+#define STATSD_VALUE_MAX        0x7fffffffffffffffLL
+#define STATSD_VALUE_INVALID    (-STATSD_VALUE_MAX - 1)
+#define STATSD_VALUE_LEN        (NGX_INT64_LEN + sizeof(".000000") - 1)
+
+/* sample rates are kept in 1/10000 */
+#define STATSD_RATE_SCALE 10000
+
+#if defined nginx_version && nginx_version >= 8021
+typedef ngx_addr_t ngx_dogstatsd_addr_t;
+#else
+typedef ngx_peer_addr_t ngx_dogstatsd_addr_t;
+#endif
+
+/*
+ * "dogstatsd_server file:" endpoints append their datagrams to a ring
+ * mapped from a file, shared by all workers: a header, and records of
+ * a ngx_dogstatsd_record_t and the datagram, padded to 16 bytes.  The
+ * records of the last "size" bytes written are in the file, the record
+ * written at position "pos" of the stream starts at pos % size.
+ */
+#define STATSD_RING_MAGIC         "DSDRING1"
+#define STATSD_RING_RECORD_MAGIC  0xfffed5d5
+#define STATSD_RING_ALIGNMENT     16
+#define STATSD_RING_DEFAULT_SIZE  (16 * 1024 * 1024)
+#define STATSD_RING_MIN_SIZE      (64 * 1024)
+
+typedef struct {
+    u_char                     magic[8];
+    uint64_t                   size;	/* bytes of records after the header */
+    uint64_t                   pos;		/* bytes written since the file was created */
+    u_char                     reserved[40];
+} ngx_dogstatsd_ring_t;
+
+typedef struct {
+    uint32_t                   magic;	/* written last */
+    uint32_t                   len;		/* of the datagram */
+    uint64_t                   usec;	/* time of the send, since the epoch */
+} ngx_dogstatsd_record_t;
+
+typedef struct {
+    ngx_dogstatsd_addr_t         peer_addr;
+    ngx_resolver_connection_t *udp_connection;
+    ngx_log_t                 *log;
+
+    /* capture file of "dogstatsd_server file:", instead of the peer */
+    ngx_str_t                  file;
+    size_t                     file_size;
+    ngx_dogstatsd_ring_t      *ring;
+
+    /* datagram being assembled by ngx_dogstatsd_buffer_line() */
+    size_t                     len;
+    u_char                     buf[STATSD_MAX_STR];
+
+    /* series of the current interval, the pool is created on first use */
+    ngx_pool_t                *series_pool;
+    ngx_rbtree_t               series;
+    ngx_rbtree_node_t          series_sentinel;
+    ngx_uint_t                 nseries;
+    ngx_uint_t                 series_dropped;	/* values, logged once per interval */
+} ngx_udp_endpoint_t;
+
+/* lost datagrams, indexed by the class of the failed send(), and values */
+#define STATSD_ERR_EAGAIN       0
+#define STATSD_ERR_ECONNREFUSED 1
+#define STATSD_ERR_EMSGSIZE     2
+#define STATSD_ERR_ENOBUFS      3
+#define STATSD_ERR_INCOMPLETE   4
+#define STATSD_ERR_OTHER        5
+#define STATSD_ERR_SERIES       6	/* values of series past STATSD_MAX_SERIES */
+#define STATSD_ERR_MAX          7
+
+/* per worker counters of what the module itself does */
+typedef struct {
+	ngx_uint_t					lines;
+	ngx_uint_t					datagrams;
+	ngx_uint_t					bytes;
+	ngx_uint_t					send_errors;
+	ngx_uint_t					connect_errors;
+	ngx_uint_t					truncated;
+	ngx_uint_t					sampled_out;
+	ngx_uint_t					handler_time;	/* nanoseconds */
+	ngx_uint_t					errors[STATSD_ERR_MAX];
+} ngx_dogstatsd_stats_t;
+
+
+/*
+ * counters of the worker, shared by the http and stream modules when they
+ * are built into nginx; each dynamic module links its own copy
+ */
+extern ngx_dogstatsd_stats_t  ngx_dogstatsd_stats;
+
+
+ngx_int_t ngx_dogstatsd_init_endpoint(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint);
+char *ngx_dogstatsd_set_file(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint,
+    ngx_str_t *value, ngx_str_t *size);
+ngx_int_t ngx_dogstatsd_udp_send(ngx_udp_endpoint_t *l, u_char *buf, size_t len);
+void ngx_dogstatsd_buffer_line(ngx_udp_endpoint_t *l, u_char *line, size_t len);
+void ngx_dogstatsd_buffer_flush(ngx_udp_endpoint_t *l);
+
+ngx_str_t *ngx_dogstatsd_get_env_value(ngx_conf_t *cf, ngx_str_t *value);
+int64_t ngx_dogstatsd_metric_value(ngx_str_t *value, ngx_uint_t seconds);
+u_char *ngx_dogstatsd_format_value(u_char *buf, int64_t value);
+u_char *ngx_dogstatsd_format_line(u_char *line, ngx_str_t *key, ngx_str_t *suffix,
+    int64_t value, const char *type, ngx_uint_t rate, ngx_str_t *tags);
+uintptr_t ngx_escape_dogstatsd_key(u_char *dst, u_char *src, size_t size);
+
+
+static ngx_inline ngx_uint_t
+ngx_dogstatsd_clock(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ngx_uint_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+
+#endif /* _NGX_DOGSTATSD_H_INCLUDED_ */
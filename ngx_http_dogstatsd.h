@@ -0,0 +1,58 @@
+/*
+ * nginx-dogstatsd module
+ * Copyright (C) 2017 Matt Robenolt
+ *
+ * Interface for other modules to send metrics through the endpoint,
+ * sampling and aggregation configured for a request.
+ */
+#ifndef _NGX_HTTP_DOGSTATSD_H_INCLUDED_
+#define _NGX_HTTP_DOGSTATSD_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_DOGSTATSD_COUNTER       0x0001
+#define NGX_HTTP_DOGSTATSD_TIMING        0x0002
+#define NGX_HTTP_DOGSTATSD_GAUGE         0x0004
+#define NGX_HTTP_DOGSTATSD_DISTRIBUTION  0x0008
+#define NGX_HTTP_DOGSTATSD_HISTOGRAM     0x0010
+#define NGX_HTTP_DOGSTATSD_SET           0x0020
+
+
+/*
+ * Sends "key:value|type|#tags" to the dogstatsd_server of the location of
+ * the request, as if it was configured with a directive of that type:
+ * distributions and histograms are aggregated, timings are packed with
+ * dogstatsd_pack_timings, and the line goes through the same sampling.
+ * The dogstatsd_rate_budget exemption of 5xx responses only applies once
+ * the response status is known, before that lines are always subject to
+ * the budget.
+ * "rate" is a sample rate in percent, 0 uses dogstatsd_sample_rate; "tags"
+ * may be NULL.  Timings are in milliseconds.
+ *
+ * Lines are not sent right away but buffered in the datagram of the
+ * endpoint, which is sent once full, at the end of the log phase of a
+ * request the module is on for, or by ngx_http_dogstatsd_flush().
+ *
+ * Returns NGX_OK if the value was sent or collected, NGX_DECLINED if the
+ * module is off for the request, the value was sampled out or is not valid
+ * for the type, and NGX_ERROR otherwise.
+ */
+ngx_int_t ngx_http_dogstatsd_emit(ngx_http_request_t *r, ngx_uint_t type,
+    ngx_str_t *key, ngx_int_t value, ngx_str_t *tags, ngx_uint_t rate);
+
+/* Adds "member" to the set "key", see dogstatsd_set. */
+ngx_int_t ngx_http_dogstatsd_emit_set(ngx_http_request_t *r, ngx_str_t *key,
+    ngx_str_t *member, ngx_str_t *tags);
+
+/*
+ * Sends the lines buffered for the dogstatsd_server of the location of the
+ * request.  Returns NGX_DECLINED if the module is off for the request.
+ */
+ngx_int_t ngx_http_dogstatsd_flush(ngx_http_request_t *r);
+
+
+#endif /* _NGX_HTTP_DOGSTATSD_H_INCLUDED_ */
@@ -15,46 +15,120 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <nginx.h>
-#include <stdlib.h>  /* for getenv() */
+#include "ngx_dogstatsd.h"
+#include "ngx_http_dogstatsd.h"
 
-#define STATSD_DEFAULT_PORT 			8125
+#define STATSD_TYPE_COUNTER	NGX_HTTP_DOGSTATSD_COUNTER
+#define STATSD_TYPE_TIMING  NGX_HTTP_DOGSTATSD_TIMING
+#define STATSD_TYPE_GAUGE   NGX_HTTP_DOGSTATSD_GAUGE
+#define STATSD_TYPE_DISTRIBUTION NGX_HTTP_DOGSTATSD_DISTRIBUTION
+#define STATSD_TYPE_HISTOGRAM    NGX_HTTP_DOGSTATSD_HISTOGRAM
+#define STATSD_TYPE_SET          NGX_HTTP_DOGSTATSD_SET
 
-#define STATSD_TYPE_COUNTER	0x0001
-#define STATSD_TYPE_TIMING  0x0002
+/* requests registered by dogstatsd_inflight, not a DogStatsD type */
+#define STATSD_TYPE_INFLIGHT     0x0040
+
+/* types collected by the worker and sent every dogstatsd_aggregate_interval */
+#define STATSD_TYPE_AGGREGATED  (STATSD_TYPE_DISTRIBUTION|STATSD_TYPE_HISTOGRAM|STATSD_TYPE_SET)
+
+/* types whose values are in milliseconds, fractions of a number are seconds */
+#define STATSD_TYPE_MSEC  (STATSD_TYPE_TIMING|STATSD_TYPE_DISTRIBUTION|STATSD_TYPE_HISTOGRAM)
 
 /*
- * Max StatsD message length = 1472
- * - 1 ASCII character = 1 byte
- * - 1 UDP packet payload = 1472 bytes ( 1500-20-8 )
-*/
-#define STATSD_MAX_STR 1472
+ * The adaptive sampler measures the lines offered over windows of
+ * STATSD_RATE_WINDOW, but reacts to a spike after STATSD_RATE_REACT.
+ */
+#define STATSD_RATE_WINDOW 1000
+#define STATSD_RATE_REACT  100
+
+/*
+ * Sketches count values in log-linear buckets: values below
+ * 2^STATSD_SKETCH_BITS have their own bucket, larger ones share a bucket
+ * with the values having the same STATSD_SKETCH_BITS most significant
+ * bits, so the middle of a bucket is within 1/2^(STATSD_SKETCH_BITS+1)
+ * (0.8%) of any value it holds.  Buckets count samples in
+ * 1/STATSD_SKETCH_UNIT, so that sampled values weigh 1/rate.
+ */
+#define STATSD_SKETCH_BITS 6
+#define STATSD_SKETCH_UNIT 100
+
+/*
+ * Sets remember the hashes of their first STATSD_SET_EXACT members, and
+ * then switch to a HyperLogLog of 2^STATSD_HLL_BITS registers, whose
+ * standard error is 1.04 / sqrt(2^STATSD_HLL_BITS), 1.6%.
+ */
+#define STATSD_SET_EXACT 64
+#define STATSD_HLL_BITS  12
+
+/* series collected by a worker for one endpoint during an interval */
+#define STATSD_MAX_SERIES 10000
 
 #define ngx_conf_merge_ptr_value(conf, prev, default)            		\
  	if (conf == NGX_CONF_UNSET_PTR) {                               	\
         conf = (prev == NGX_CONF_UNSET_PTR) ? default : prev;           \
 	}
 
-#if defined nginx_version && nginx_version >= 8021
-typedef ngx_addr_t ngx_dogstatsd_addr_t;
-#else
-typedef ngx_peer_addr_t ngx_dogstatsd_addr_t;
-#endif
+typedef struct {
+    uint32_t                  *counts;
+    ngx_uint_t                 offset;	/* bucket of counts[0] */
+    ngx_uint_t                 size;
+} ngx_dogstatsd_sketch_t;
 
 typedef struct {
-    ngx_dogstatsd_addr_t         peer_addr;
-    ngx_resolver_connection_t *udp_connection;
-    ngx_log_t                 *log;
-} ngx_udp_endpoint_t;
+    ngx_str_node_t             sn;		/* "key|type[|@rate][|#tags]", type in decimal */
+    ngx_uint_t                 type;
+    ngx_str_t                  key;
+    ngx_str_t                  tags;
+    ngx_uint_t                 rate;
+    ngx_dogstatsd_sketch_t     sketch;
+    ngx_array_t               *values;	/* packed timings */
+    size_t                     values_len;	/* of the values printed, with separators */
+    uint32_t                  *members;	/* set member hashes while the set is small */
+    ngx_uint_t                 nmembers;
+    u_char                    *registers;	/* HyperLogLog of larger sets */
+    ngx_uint_t                 active;		/* in-flight requests */
+    off_t                      sent;
+    off_t                      received;
+} ngx_dogstatsd_series_t;
 
 typedef struct {
 	ngx_array_t                *endpoints;
+
+	/* endpoint of the http{} block, used for metrics sent from timers */
+	ngx_udp_endpoint_t         *endpoint;
+
+	ngx_msec_t                  internal_interval;
+	ngx_str_t                   internal_tags;
+
+	ngx_msec_t                  client_interval;
+	ngx_str_t                   client_tags;
+
+	ngx_uint_t                  rate_budget;
+
+	ngx_msec_t                  aggregate_interval;
+	ngx_flag_t                  aggregate;
+
+	ngx_flag_t                  pack_timings;
+
+	ngx_flag_t                  inflight;
+
+	ngx_str_t                   error_log_prefix;	/* empty if not counted */
 } ngx_http_dogstatsd_main_conf_t;
 
+/* per worker state of dogstatsd_rate_budget */
+typedef struct {
+	ngx_msec_t					start;		/* start of the current window */
+	ngx_uint_t					offered;	/* lines offered in the current window */
+	ngx_uint_t					ewma;		/* smoothed lines per second */
+	ngx_uint_t					rate;
+} ngx_http_dogstatsd_sampler_t;
+
 typedef struct {
 	ngx_uint_t			   	    type;
 
 	ngx_str_t			   		key;
-	ngx_uint_t			   		metric;
+	int64_t			   			metric;
+	ngx_str_t			   		member;
 	ngx_str_t			   		tags;
 	ngx_flag_t					valid;
 
@@ -69,11 +143,52 @@ typedef struct {
     ngx_udp_endpoint_t      *endpoint;
 	ngx_uint_t				sample_rate;
 	ngx_array_t				*stats;
+
+	ngx_http_complex_value_t	*inflight_key;
+	ngx_http_complex_value_t	*inflight_tags;
 } ngx_http_dogstatsd_conf_t;
 
+/* classes of error_log messages counted by dogstatsd_error_log_metrics */
+typedef struct {
+	ngx_str_t					name;
+	char						*text;
+} ngx_http_dogstatsd_log_class_t;
+
+/* a log counting the messages of another, see ngx_http_dogstatsd_log_hook() */
+typedef struct ngx_http_dogstatsd_log_hook_s  ngx_http_dogstatsd_log_hook_t;
+
+struct ngx_http_dogstatsd_log_hook_s {
+	ngx_log_t						counter;	/* inserted after "log" */
+	ngx_log_t						*log;
+	ngx_http_dogstatsd_log_hook_t	*next;
+};
 
-static void ngx_dogstatsd_updater_cleanup(void *data);
-static ngx_int_t ngx_http_dogstatsd_udp_send(ngx_udp_endpoint_t *l, u_char *buf, size_t len);
+/* a request registered by dogstatsd_inflight, lives in the request pool */
+typedef struct {
+	ngx_queue_t					queue;
+	ngx_http_request_t			*request;
+	ngx_udp_endpoint_t			*endpoint;
+	ngx_str_t					key;
+	ngx_str_t					tags;
+
+	/* bytes already accounted for */
+	off_t						sent;
+	off_t						received;
+	off_t						upgraded;	/* -1 before an upgrade */
+} ngx_http_dogstatsd_inflight_t;
+
+
+static void ngx_http_dogstatsd_aggregate(ngx_udp_endpoint_t *e, ngx_uint_t type, ngx_str_t *key,
+    ngx_str_t *tags, int64_t value, ngx_uint_t rate);
+static void ngx_http_dogstatsd_values_flush(ngx_udp_endpoint_t *e,
+    ngx_dogstatsd_series_t *series);
+static void ngx_http_dogstatsd_inflight_cleanup(void *data);
+static ngx_uint_t ngx_http_dogstatsd_sample(ngx_http_request_t *r, ngx_uint_t rate,
+    ngx_uint_t lines);
+static void ngx_http_dogstatsd_send(ngx_http_request_t *r, ngx_udp_endpoint_t *e,
+    ngx_uint_t type, ngx_str_t *key, ngx_str_t *tags, int64_t value, ngx_uint_t rate);
+static void ngx_http_dogstatsd_aggregate_member(ngx_udp_endpoint_t *e, ngx_str_t *key,
+    ngx_str_t *tags, ngx_str_t *member);
 
 static void *ngx_http_dogstatsd_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_dogstatsd_create_loc_conf(ngx_conf_t *cf);
@@ -84,22 +199,66 @@ static char *ngx_http_dogstatsd_set_server(ngx_conf_t *cf, ngx_command_t *cmd, v
 static char *ngx_http_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf, ngx_uint_t type);
 static char *ngx_http_dogstatsd_add_count(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_dogstatsd_add_timing(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_add_distribution(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_add_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_add_gauge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_add_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_set_inflight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_set_internal_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_set_client_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_dogstatsd_set_error_log_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static ngx_str_t ngx_http_dogstatsd_key_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_str_t v);
 static ngx_str_t ngx_http_dogstatsd_key_value(ngx_str_t *str);
-static ngx_uint_t ngx_http_dogstatsd_metric_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_uint_t v);
-static ngx_uint_t ngx_http_dogstatsd_metric_value(ngx_str_t *str);
+static int64_t ngx_http_dogstatsd_metric_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, int64_t v, ngx_uint_t seconds);
 static ngx_flag_t ngx_http_dogstatsd_valid_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_flag_t v);
 static ngx_flag_t ngx_http_dogstatsd_valid_value(ngx_str_t *str);
 
-uintptr_t ngx_escape_dogstatsd_key(u_char *dst, u_char *src, size_t size);
+static ngx_int_t ngx_http_dogstatsd_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_dogstatsd_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 
 static ngx_int_t ngx_http_dogstatsd_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_dogstatsd_init_process(ngx_cycle_t *cycle);
+static void ngx_http_dogstatsd_internal_metrics_handler(ngx_event_t *ev);
+static void ngx_http_dogstatsd_client_metrics_handler(ngx_event_t *ev);
+static void ngx_http_dogstatsd_aggregate_handler(ngx_event_t *ev);
+static void ngx_http_dogstatsd_aggregate_start(ngx_http_dogstatsd_main_conf_t *umcf,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_dogstatsd_log_hook_location(ngx_cycle_t *cycle,
+    ngx_http_core_loc_conf_t *clcf);
+static void ngx_http_dogstatsd_error_log_flush(ngx_http_dogstatsd_main_conf_t *umcf);
+static void ngx_http_dogstatsd_exit_process(ngx_cycle_t *cycle);
+static char *ngx_http_dogstatsd_check_interval(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_dogstatsd_check_budget(ngx_conf_t *cf, void *post, void *data);
+
+/* a timer of 0 would run again in every cycle of the event loop */
+static ngx_conf_post_handler_pt  ngx_http_dogstatsd_interval_p =
+    ngx_http_dogstatsd_check_interval;
+
+/* a budget of 0 would sample out everything but 5xx responses */
+static ngx_conf_post_handler_pt  ngx_http_dogstatsd_budget_p =
+    ngx_http_dogstatsd_check_budget;
+
+static ngx_event_t  ngx_http_dogstatsd_internal_event;
+static ngx_event_t  ngx_http_dogstatsd_client_event;
+static ngx_event_t  ngx_http_dogstatsd_aggregate_event;
+
+static ngx_dogstatsd_stats_t  ngx_http_dogstatsd_stats_sent;
+
+static ngx_http_dogstatsd_sampler_t  ngx_http_dogstatsd_sampler;
+
+static ngx_http_dogstatsd_log_hook_t  *ngx_http_dogstatsd_log_hooks;
+static ngx_uint_t  ngx_http_dogstatsd_log_levels[NGX_LOG_DEBUG + 1];
+
+static ngx_queue_t  ngx_http_dogstatsd_inflight_requests = {
+    &ngx_http_dogstatsd_inflight_requests, &ngx_http_dogstatsd_inflight_requests
+};
 
 static ngx_command_t  ngx_http_dogstatsd_commands[] = {
 
 	{ ngx_string("dogstatsd_server"),
-	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
 	  ngx_http_dogstatsd_set_server,
 	  NGX_HTTP_LOC_CONF_OFFSET,
 	  0,
@@ -112,6 +271,13 @@ static ngx_command_t  ngx_http_dogstatsd_commands[] = {
 	  offsetof(ngx_http_dogstatsd_conf_t, sample_rate),
 	  NULL },
 
+	{ ngx_string("dogstatsd_rate_budget"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_num_slot,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  offsetof(ngx_http_dogstatsd_main_conf_t, rate_budget),
+	  &ngx_http_dogstatsd_budget_p },
+
 	{ ngx_string("dogstatsd_count"),
 	  NGX_HTTP_SRV_CONF|NGX_HTTP_SIF_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
 	  ngx_http_dogstatsd_add_count,
@@ -126,12 +292,82 @@ static ngx_command_t  ngx_http_dogstatsd_commands[] = {
 	  0,
 	  NULL },
 
+	{ ngx_string("dogstatsd_distribution"),
+	  NGX_HTTP_SRV_CONF|NGX_HTTP_SIF_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+	  ngx_http_dogstatsd_add_distribution,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_histogram"),
+	  NGX_HTTP_SRV_CONF|NGX_HTTP_SIF_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+	  ngx_http_dogstatsd_add_histogram,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_gauge"),
+	  NGX_HTTP_SRV_CONF|NGX_HTTP_SIF_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+	  ngx_http_dogstatsd_add_gauge,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_set"),
+	  NGX_HTTP_SRV_CONF|NGX_HTTP_SIF_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+	  ngx_http_dogstatsd_add_set,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_inflight"),
+	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+	  ngx_http_dogstatsd_set_inflight,
+	  NGX_HTTP_LOC_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_aggregate_interval"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+	  ngx_conf_set_msec_slot,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  offsetof(ngx_http_dogstatsd_main_conf_t, aggregate_interval),
+	  &ngx_http_dogstatsd_interval_p },
+
+	{ ngx_string("dogstatsd_pack_timings"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+	  ngx_conf_set_flag_slot,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  offsetof(ngx_http_dogstatsd_main_conf_t, pack_timings),
+	  NULL },
+
+	{ ngx_string("dogstatsd_internal_metrics"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	  ngx_http_dogstatsd_set_internal_metrics,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_client_metrics"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	  ngx_http_dogstatsd_set_client_metrics,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dogstatsd_error_log_metrics"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+	  ngx_http_dogstatsd_set_error_log_metrics,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_dogstatsd_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_dogstatsd_add_variables,         /* preconfiguration */
     ngx_http_dogstatsd_init,                  /* postconfiguration */
 
     ngx_http_dogstatsd_create_main_conf,      /* create main configuration */
@@ -152,14 +388,100 @@ ngx_module_t  ngx_http_dogstatsd_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_dogstatsd_init_process,          /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_dogstatsd_exit_process,          /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
+
+static ngx_http_variable_t  ngx_http_dogstatsd_vars[] = {
+
+    { ngx_string("dogstatsd_lines"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, lines), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_datagrams"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, datagrams), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_bytes"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, bytes), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_send_errors"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, send_errors), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_connect_errors"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, connect_errors), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_truncated"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, truncated), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_sampled_out"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, sampled_out), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dogstatsd_handler_time"), NULL, ngx_http_dogstatsd_stats_variable,
+      offsetof(ngx_dogstatsd_stats_t, handler_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
+typedef struct {
+    char        *name;
+    ngx_uint_t   offset;
+} ngx_http_dogstatsd_client_metric_t;
+
+static ngx_http_dogstatsd_client_metric_t  ngx_http_dogstatsd_client_metrics[] = {
+    { "datadog.dogstatsd.client.metrics",
+      offsetof(ngx_dogstatsd_stats_t, lines) },
+    { "datadog.dogstatsd.client.packets_sent",
+      offsetof(ngx_dogstatsd_stats_t, datagrams) },
+    { "datadog.dogstatsd.client.bytes_sent",
+      offsetof(ngx_dogstatsd_stats_t, bytes) },
+    { "datadog.dogstatsd.client.connect_errors",
+      offsetof(ngx_dogstatsd_stats_t, connect_errors) },
+    { "datadog.dogstatsd.client.truncated",
+      offsetof(ngx_dogstatsd_stats_t, truncated) },
+    { "datadog.dogstatsd.client.sampled_out",
+      offsetof(ngx_dogstatsd_stats_t, sampled_out) },
+    { "datadog.dogstatsd.client.handler_time",
+      offsetof(ngx_dogstatsd_stats_t, handler_time) },
+    { NULL, 0 }
+};
+
+static ngx_str_t  ngx_http_dogstatsd_errors[] = {
+    ngx_string("eagain"),
+    ngx_string("econnrefused"),
+    ngx_string("emsgsize"),
+    ngx_string("enobufs"),
+    ngx_string("incomplete"),
+    ngx_string("other"),
+    ngx_string("too_many_series")
+};
+
+static ngx_str_t  ngx_http_dogstatsd_log_level_names[] = {
+    ngx_string("stderr"),
+    ngx_string("emerg"),
+    ngx_string("alert"),
+    ngx_string("crit"),
+    ngx_string("error"),
+    ngx_string("warn"),
+    ngx_string("notice"),
+    ngx_string("info"),
+    ngx_string("debug")
+};
+
+static ngx_http_dogstatsd_log_class_t  ngx_http_dogstatsd_log_classes[] = {
+    { ngx_string("upstream_timed_out"), "upstream timed out" },
+    { ngx_string("connection_refused"), "Connection refused" },
+    { ngx_string("no_live_upstreams"), "no live upstreams" },
+    { ngx_null_string, NULL }
+};
+
+static ngx_uint_t  ngx_http_dogstatsd_log_counts[
+    sizeof(ngx_http_dogstatsd_log_classes) / sizeof(ngx_http_dogstatsd_log_class_t) - 1];
+
 static ngx_str_t
 ngx_http_dogstatsd_key_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_str_t v)
 {
@@ -181,8 +503,8 @@ ngx_http_dogstatsd_key_value(ngx_str_t *value)
 	return *value;
 };
 
-static ngx_uint_t
-ngx_http_dogstatsd_metric_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, ngx_uint_t v)
+static int64_t
+ngx_http_dogstatsd_metric_get_value(ngx_http_request_t *r, ngx_http_complex_value_t *cv, int64_t v, ngx_uint_t seconds)
 {
 	ngx_str_t val;
 	if (cv == NULL) {
@@ -190,35 +512,10 @@ ngx_http_dogstatsd_metric_get_value(ngx_http_request_t *r, ngx_http_complex_valu
 	}
 
 	if (ngx_http_complex_value(r, cv, &val) != NGX_OK) {
-		return 0;
-	};
-
-	return ngx_http_dogstatsd_metric_value(&val);
-};
-
-static ngx_uint_t
-ngx_http_dogstatsd_metric_value(ngx_str_t *value)
-{
-	ngx_int_t n, m;
-
-    if (value->len == 1 && value->data[0] == '-') {
-    	return (ngx_uint_t) -1;
-	};
-
-	/* Hack to convert milliseconds to a number. */
-	if (value->len > 4 && value->data[value->len - 4] == '.') {
-		n = ngx_atoi(value->data, value->len - 4);
-		m = ngx_atoi(value->data + (value->len - 3), 3);
-		return (ngx_uint_t) ((n * 1000) + m);
-
-	} else {
-		n = ngx_atoi(value->data, value->len);
-		if (n > 0) {
-			return (ngx_uint_t) n;
-		};
+		return STATSD_VALUE_INVALID;
 	};
 
-	return 0;
+	return ngx_dogstatsd_metric_value(&val, seconds);
 };
 
 static ngx_flag_t
@@ -242,19 +539,137 @@ ngx_http_dogstatsd_valid_value(ngx_str_t *value)
 	return (ngx_flag_t) (value->len > 0 ? 1 : 0);
 };
 
+/*
+ * Returns the sample rate that keeps the lines sent by this worker under
+ * "budget" per second, given that the current request offers "lines".
+ */
+static ngx_uint_t
+ngx_http_dogstatsd_adaptive_rate(ngx_uint_t budget, ngx_uint_t lines)
+{
+    ngx_msec_t                     elapsed;
+    ngx_uint_t                     current;
+    ngx_http_dogstatsd_sampler_t  *s;
+
+    s = &ngx_http_dogstatsd_sampler;
+
+    if (s->rate == 0) {
+        s->start = ngx_current_msec;
+        s->rate = STATSD_RATE_SCALE;
+    }
+
+    s->offered += lines;
+    elapsed = ngx_current_msec - s->start;
+
+    if (elapsed < STATSD_RATE_REACT) {
+        return s->rate;
+    }
+
+    current = s->offered * 1000 / elapsed;
+
+    if (elapsed >= STATSD_RATE_WINDOW) {
+        s->ewma = (s->ewma + current) / 2;
+        s->start = ngx_current_msec;
+        s->offered = 0;
+
+    } else if (current > s->ewma * 2) {
+        /* do not wait for the end of the window to follow a spike */
+        s->ewma = current;
+
+    } else {
+        return s->rate;
+    }
+
+    if (s->ewma <= budget) {
+        s->rate = STATSD_RATE_SCALE;
+
+    } else {
+        s->rate = ngx_max(budget * STATSD_RATE_SCALE / s->ewma, 1);
+    }
+
+    return s->rate;
+}
+
+/*
+ * Returns the sample rate in 1/STATSD_RATE_SCALE to send "lines" with,
+ * or 0 if they are sampled out.  "rate" is the configured rate in percent.
+ */
+static ngx_uint_t
+ngx_http_dogstatsd_sample(ngx_http_request_t *r, ngx_uint_t rate, ngx_uint_t lines)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_dogstatsd_module);
+
+    rate *= STATSD_RATE_SCALE / 100;
+
+    // Errors are always worth their bytes, keep them out of the budget.
+    if (umcf->rate_budget != NGX_CONF_UNSET_UINT
+        && r->headers_out.status < NGX_HTTP_INTERNAL_SERVER_ERROR)
+    {
+        rate = ngx_min(rate, ngx_http_dogstatsd_adaptive_rate(umcf->rate_budget, lines));
+    }
+
+    // Use a random distribution to sample at sample rate.
+    if (rate < STATSD_RATE_SCALE && (ngx_uint_t) (ngx_random() % STATSD_RATE_SCALE) >= rate) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "dogstatsd: skipping sample");
+        ngx_dogstatsd_stats.sampled_out += lines;
+        return 0;
+    }
+
+    return rate;
+}
+
+/*
+ * Buffers a value in the datagram of the endpoint, or collects it in the
+ * series of the endpoint if the type is aggregated.  The key is already
+ * escaped.
+ */
+static void
+ngx_http_dogstatsd_send(ngx_http_request_t *r, ngx_udp_endpoint_t *e, ngx_uint_t type,
+    ngx_str_t *key, ngx_str_t *tags, int64_t value, ngx_uint_t rate)
+{
+    u_char                          line[STATSD_MAX_STR], *p;
+    const char                     *metric_type;
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_dogstatsd_module);
+
+    if ((type & STATSD_TYPE_AGGREGATED)
+        || (type == STATSD_TYPE_TIMING && umcf->pack_timings))
+    {
+        ngx_http_dogstatsd_aggregate(e, type, key, tags, value, rate);
+        return;
+    }
+
+    if (type == STATSD_TYPE_COUNTER) {
+        metric_type = "c";
+    } else if (type == STATSD_TYPE_TIMING) {
+        metric_type = "ms";
+    } else if (type == STATSD_TYPE_GAUGE) {
+        metric_type = "g";
+    } else {
+        return;
+    }
+
+    p = ngx_dogstatsd_format_line(line, key, NULL, value, metric_type, rate, tags);
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+}
+
 ngx_int_t
 ngx_http_dogstatsd_handler(ngx_http_request_t *r)
 {
-    u_char                    line[STATSD_MAX_STR], *p;
-    const char *              metric_type;
     ngx_http_dogstatsd_conf_t   *ulcf;
 	ngx_dogstatsd_stat_t 		 *stats;
 	ngx_dogstatsd_stat_t		  stat;
 	ngx_uint_t 			      c;
-	ngx_uint_t				  n;
+	int64_t					  n;
 	ngx_str_t				  s;
 	ngx_str_t				  t;
+	ngx_str_t				  m;
 	ngx_flag_t				  b;
+	ngx_uint_t				  start;
+	ngx_uint_t				  rate;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http dogstatsd handler");
@@ -266,9 +681,13 @@ ngx_http_dogstatsd_handler(ngx_http_request_t *r)
         return NGX_OK;
     }
 
-	// Use a random distribution to sample at sample rate.
-	if (ulcf->sample_rate < 100 && (uint) (ngx_random() % 100) >= ulcf->sample_rate) {
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "dogstatsd: skipping sample");
+	start = ngx_dogstatsd_clock();
+
+	rate = ngx_http_dogstatsd_sample(r, ulcf->sample_rate, ulcf->stats->nelts);
+	if (rate == 0) {
+		/* lines emitted through the API while processing the request */
+		ngx_dogstatsd_buffer_flush(ulcf->endpoint);
+		ngx_dogstatsd_stats.handler_time += ngx_dogstatsd_clock() - start;
 		return NGX_OK;
 	}
 
@@ -279,226 +698,1515 @@ ngx_http_dogstatsd_handler(ngx_http_request_t *r)
 		s = ngx_http_dogstatsd_key_get_value(r, stat.ckey, stat.key);
 		ngx_escape_dogstatsd_key(s.data, s.data, s.len);
 
-		n = ngx_http_dogstatsd_metric_get_value(r, stat.cmetric, stat.metric);
 		t = ngx_http_dogstatsd_key_get_value(r, stat.ctags, stat.tags);
 		b = ngx_http_dogstatsd_valid_get_value(r, stat.cvalid, stat.valid);
 
-		if (b == 0 || s.len == 0 || (stat.type == STATSD_TYPE_COUNTER && n == 0)) {
-			// Do not log if not valid, key is invalid, counters can't be 0
+		if (stat.type == STATSD_TYPE_SET) {
+			m = ngx_http_dogstatsd_key_get_value(r, stat.cmetric, stat.member);
+
+			if (b == 0 || s.len == 0 || m.len == 0) {
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "dogstatsd: no member to add");
+				continue;
+			}
+
+			ngx_http_dogstatsd_aggregate_member(ulcf->endpoint, &s, &t, &m);
+			continue;
+		}
+
+		n = ngx_http_dogstatsd_metric_get_value(r, stat.cmetric, stat.metric,
+			stat.type & STATSD_TYPE_MSEC);
+
+		if (b == 0 || s.len == 0 || n == STATSD_VALUE_INVALID
+			|| (stat.type == STATSD_TYPE_COUNTER && n == 0)
+			|| ((stat.type & STATSD_TYPE_MSEC) && n < 0))
+		{
+			// Do not log if not valid, key or value is invalid, counters can't be 0
+			// and times can't be negative
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "dogstatsd: no value to send");
          	continue;
 		};
 
-		if (stat.type == STATSD_TYPE_COUNTER) {
-			metric_type = "c";
-		} else if (stat.type == STATSD_TYPE_TIMING) {
-			metric_type = "ms";
-		} else {
-			metric_type = NULL;
-		}
-
-		if (metric_type) {
-			if (ulcf->sample_rate < 100) {
-				if (t.len == 0) {
-					p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%d|%s|@0.%02d", &s, n, metric_type, ulcf->sample_rate);
-				} else {
-					p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%d|%s|@0.%02d|#%V", &s, n, metric_type, ulcf->sample_rate, &t);
-				}
-			} else {
-				if (t.len == 0) {
-					p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%d|%s", &s, n, metric_type);
-				} else {
-					p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%d|%s|#%V", &s, n, metric_type, &t);
-				}
-			}
-			ngx_http_dogstatsd_udp_send(ulcf->endpoint, line, p - line);
-		}
+		ngx_http_dogstatsd_send(r, ulcf->endpoint, stat.type, &s, &t, n, rate);
 	}
 
+	ngx_dogstatsd_buffer_flush(ulcf->endpoint);
+
+	ngx_dogstatsd_stats.handler_time += ngx_dogstatsd_clock() - start;
+
     return NGX_OK;
 }
 
-static ngx_int_t ngx_dogstatsd_init_endpoint(ngx_conf_t *cf, ngx_udp_endpoint_t *endpoint) {
-    ngx_pool_cleanup_t    *cln;
-    ngx_resolver_connection_t  *rec;
+/*
+ * The key given to the API belongs to the caller, it is escaped in a copy.
+ */
+static ngx_int_t
+ngx_http_dogstatsd_api_key(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *escaped)
+{
+    ngx_http_dogstatsd_conf_t  *ulcf;
+
+    ulcf = ngx_http_get_module_loc_conf(r, ngx_http_dogstatsd_module);
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
-			   "dogstatsd: initting endpoint");
+    if (ulcf->off == 1 || ulcf->endpoint == NULL || key == NULL || key->len == 0) {
+        return NGX_DECLINED;
+    }
 
-    cln = ngx_pool_cleanup_add(cf->pool, 0);
-    if(cln == NULL) {
+    escaped->len = ngx_min(key->len, STATSD_MAX_STR);
+    escaped->data = ngx_pnalloc(r->pool, escaped->len);
+    if (escaped->data == NULL) {
         return NGX_ERROR;
     }
 
-    cln->handler = ngx_dogstatsd_updater_cleanup;
-    cln->data = endpoint;
+    ngx_escape_dogstatsd_key(escaped->data, key->data, escaped->len);
 
-    rec = ngx_calloc(sizeof(ngx_resolver_connection_t), cf->log);
-    if (rec == NULL) {
-        return NGX_ERROR;
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_dogstatsd_emit(ngx_http_request_t *r, ngx_uint_t type, ngx_str_t *key,
+    ngx_int_t value, ngx_str_t *tags, ngx_uint_t rate)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        s, t;
+    ngx_http_dogstatsd_conf_t       *ulcf;
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    switch (type) {
+
+    case STATSD_TYPE_COUNTER:
+        if (value == 0) {
+            return NGX_DECLINED;
+        }
+        break;
+
+    case STATSD_TYPE_GAUGE:
+        break;
+
+    case STATSD_TYPE_TIMING:
+    case STATSD_TYPE_DISTRIBUTION:
+    case STATSD_TYPE_HISTOGRAM:
+        if (value < 0) {
+            return NGX_DECLINED;
+        }
+        break;
+
+    default:
+        return NGX_DECLINED;
+    }
+
+    if (rate > 100
+        || (int64_t) value > STATSD_VALUE_MAX / STATSD_VALUE_SCALE
+        || (int64_t) value < -STATSD_VALUE_MAX / STATSD_VALUE_SCALE)
+    {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_dogstatsd_api_key(r, key, &s);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ulcf = ngx_http_get_module_loc_conf(r, ngx_http_dogstatsd_module);
+
+    rate = ngx_http_dogstatsd_sample(r, rate ? rate : ulcf->sample_rate, 1);
+    if (rate == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (tags) {
+        t = *tags;
+    } else {
+        ngx_str_null(&t);
     }
 
-    endpoint->udp_connection = rec;
+    /* no directive may have collected values of this type */
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_dogstatsd_module);
 
-    rec->sockaddr = endpoint->peer_addr.sockaddr;
-    rec->socklen = endpoint->peer_addr.socklen;
-    rec->server = endpoint->peer_addr.name;
+    if ((type & STATSD_TYPE_AGGREGATED) && !umcf->aggregate) {
+        ngx_http_dogstatsd_aggregate_start(umcf, ngx_cycle->log);
+    }
 
-    endpoint->log = &cf->cycle->new_log;
+    ngx_http_dogstatsd_send(r, ulcf->endpoint, type, &s, &t,
+                            (int64_t) value * STATSD_VALUE_SCALE, rate);
 
     return NGX_OK;
 }
 
-static void
-ngx_dogstatsd_updater_cleanup(void *data)
+ngx_int_t
+ngx_http_dogstatsd_emit_set(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *member,
+    ngx_str_t *tags)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        s, t;
+    ngx_http_dogstatsd_conf_t       *ulcf;
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    if (member == NULL || member->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_dogstatsd_api_key(r, key, &s);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ulcf = ngx_http_get_module_loc_conf(r, ngx_http_dogstatsd_module);
+
+    if (ngx_http_dogstatsd_sample(r, ulcf->sample_rate, 1) == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (tags) {
+        t = *tags;
+    } else {
+        ngx_str_null(&t);
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_dogstatsd_module);
+
+    if (!umcf->aggregate) {
+        ngx_http_dogstatsd_aggregate_start(umcf, ngx_cycle->log);
+    }
+
+    ngx_http_dogstatsd_aggregate_member(ulcf->endpoint, &s, &t, member);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_dogstatsd_flush(ngx_http_request_t *r)
+{
+    ngx_http_dogstatsd_conf_t  *ulcf;
+
+    ulcf = ngx_http_get_module_loc_conf(r, ngx_http_dogstatsd_module);
+
+    if (ulcf->off == 1 || ulcf->endpoint == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_dogstatsd_buffer_flush(ulcf->endpoint);
+
+    return NGX_OK;
+}
+
+static ngx_uint_t
+ngx_http_dogstatsd_sketch_bucket(uint64_t v)
+{
+    ngx_uint_t  e;
+
+    if (v < (1 << STATSD_SKETCH_BITS)) {
+        return (ngx_uint_t) v;
+    }
+
+    /* position of the most significant bit */
+    for (e = STATSD_SKETCH_BITS; e < sizeof(uint64_t) * 8 - 1 && (v >> (e + 1)); e++) {
+        /* void */
+    }
+
+    return ((e - STATSD_SKETCH_BITS + 1) << STATSD_SKETCH_BITS)
+           | (ngx_uint_t) ((v >> (e - STATSD_SKETCH_BITS)) & ((1 << STATSD_SKETCH_BITS) - 1));
+}
+
+/* the middle of a bucket */
+static uint64_t
+ngx_http_dogstatsd_sketch_value(ngx_uint_t bucket)
+{
+    ngx_uint_t  shift;
+
+    if (bucket < (2 << STATSD_SKETCH_BITS)) {
+        return bucket;
+    }
+
+    shift = (bucket >> STATSD_SKETCH_BITS) - 1;
+
+    return ((uint64_t) ((1 << STATSD_SKETCH_BITS) | (bucket & ((1 << STATSD_SKETCH_BITS) - 1)))
+            << shift)
+           + ((uint64_t) 1 << (shift - 1));
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_sketch_add(ngx_pool_t *pool, ngx_dogstatsd_sketch_t *sk, uint64_t v,
+    uint32_t weight)
 {
-    ngx_udp_endpoint_t  *e = data;
+    ngx_uint_t   bucket, lo, hi, size;
+    uint32_t    *counts;
+
+    bucket = ngx_http_dogstatsd_sketch_bucket(v);
+
+    if (sk->counts == NULL || bucket < sk->offset || bucket >= sk->offset + sk->size) {
+
+        /* grow the dense store to cover the bucket, at least twice as large */
+
+        if (sk->counts == NULL) {
+            lo = bucket & ~(ngx_uint_t) 15;
+            hi = lo + 16;
+
+        } else {
+            lo = ngx_min(bucket, sk->offset);
+            hi = ngx_max(bucket + 1, sk->offset + sk->size);
+            size = ngx_max(hi - lo, sk->size * 2);
+
+            if (bucket < sk->offset) {
+                lo = (hi > size) ? hi - size : 0;
+
+            } else {
+                hi = lo + size;
+            }
+        }
+
+        counts = ngx_pcalloc(pool, (hi - lo) * sizeof(uint32_t));
+        if (counts == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (sk->counts) {
+            ngx_memcpy(counts + (sk->offset - lo), sk->counts, sk->size * sizeof(uint32_t));
+        }
+
+        sk->counts = counts;
+        sk->offset = lo;
+        sk->size = hi - lo;
+    }
+
+    counts = &sk->counts[bucket - sk->offset];
+
+    *counts = (*counts > (uint32_t) -1 - weight) ? (uint32_t) -1 : *counts + weight;
+
+    return NGX_OK;
+}
+
+static const char *
+ngx_http_dogstatsd_type_name(ngx_uint_t type)
+{
+    switch (type) {
+    case STATSD_TYPE_COUNTER:
+        return "c";
+    case STATSD_TYPE_TIMING:
+        return "ms";
+    case STATSD_TYPE_GAUGE:
+        return "g";
+    case STATSD_TYPE_DISTRIBUTION:
+        return "d";
+    case STATSD_TYPE_HISTOGRAM:
+        return "h";
+    case STATSD_TYPE_SET:
+        return "s";
+    }
+
+    return NULL;
+}
+
+static ngx_dogstatsd_series_t *
+ngx_http_dogstatsd_series_get(ngx_udp_endpoint_t *e, ngx_uint_t type, ngx_str_t *key,
+    ngx_str_t *tags, ngx_uint_t rate)
+{
+    u_char                  buf[STATSD_MAX_STR], *p;
+    uint32_t                hash;
+    ngx_str_t               name;
+    ngx_dogstatsd_series_t  *series;
+
+    if (e->series_pool == NULL) {
+        e->series_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (e->series_pool == NULL) {
+            return NULL;
+        }
+
+        ngx_rbtree_init(&e->series, &e->series_sentinel, ngx_str_rbtree_insert_value);
+        e->nseries = 0;
+    }
+
+    p = ngx_snprintf(buf, STATSD_MAX_STR, "%V|%ui", key, type);
+
+    if (rate < STATSD_RATE_SCALE) {
+        p = ngx_slprintf(p, buf + STATSD_MAX_STR, "|@0.%04ui", rate);
+    }
+
+    if (tags->len) {
+        p = ngx_slprintf(p, buf + STATSD_MAX_STR, "|#%V", tags);
+    }
+
+    /* the key and tags are found back in the name, it must hold them whole */
+    if (p == buf + STATSD_MAX_STR) {
+        ngx_dogstatsd_stats.truncated++;
+        return NULL;
+    }
+
+    name.data = buf;
+    name.len = p - buf;
+
+    hash = ngx_crc32_short(name.data, name.len);
+
+    series = (ngx_dogstatsd_series_t *) ngx_str_rbtree_lookup(&e->series, &name, hash);
+    if (series != NULL) {
+        return series;
+    }
+
+    if (e->nseries >= STATSD_MAX_SERIES) {
+        ngx_dogstatsd_stats.errors[STATSD_ERR_SERIES]++;
+        e->series_dropped++;
+        return NULL;
+    }
+
+    series = ngx_pcalloc(e->series_pool, sizeof(ngx_dogstatsd_series_t) + name.len);
+    if (series == NULL) {
+        return NULL;
+    }
+
+    p = (u_char *) series + sizeof(ngx_dogstatsd_series_t);
+    ngx_memcpy(p, name.data, name.len);
+
+    series->sn.node.key = hash;
+    series->sn.str.data = p;
+    series->sn.str.len = name.len;
+    series->type = type;
+    series->rate = rate;
+    series->key.data = p;
+    series->key.len = key->len;
+
+    if (tags->len) {
+        series->tags.data = p + name.len - tags->len;
+        series->tags.len = tags->len;
+    }
+
+    ngx_rbtree_insert(&e->series, &series->sn.node);
+    e->nseries++;
+
+    return series;
+}
+
+static void
+ngx_http_dogstatsd_aggregate(ngx_udp_endpoint_t *e, ngx_uint_t type, ngx_str_t *key,
+    ngx_str_t *tags, int64_t value, ngx_uint_t rate)
+{
+    u_char                   num[STATSD_VALUE_LEN];
+    int64_t                 *v;
+    ngx_dogstatsd_series_t  *series;
+
+    if (value < 0) {
+        return;
+    }
+
+    if (type == STATSD_TYPE_TIMING) {
+
+        /* values sent with different rates can not share a line */
+
+        series = ngx_http_dogstatsd_series_get(e, type, key, tags, rate);
+        if (series == NULL) {
+            return;
+        }
+
+        if (series->values == NULL) {
+            series->values = ngx_array_create(e->series_pool, 8, sizeof(int64_t));
+            if (series->values == NULL) {
+                return;
+            }
+        }
+
+        v = ngx_array_push(series->values);
+        if (v == NULL) {
+            return;
+        }
+
+        *v = value;
+
+        /*
+         * send the values once they fill a datagram rather than keeping
+         * them all until the end of the interval
+         */
+
+        series->values_len += 1 + (ngx_dogstatsd_format_value(num, value) - num);
+
+        if (series->key.len + series->tags.len + sizeof("|ms|@0.0000|#") - 1
+            + series->values_len >= STATSD_MAX_STR)
+        {
+            ngx_http_dogstatsd_values_flush(e, series);
+            ngx_dogstatsd_buffer_flush(e);
+
+            series->values->nelts = 0;
+            series->values_len = 0;
+        }
+
+        return;
+    }
+
+    series = ngx_http_dogstatsd_series_get(e, type, key, tags, STATSD_RATE_SCALE);
+    if (series == NULL) {
+        return;
+    }
+
+    /* a sampled value stands for 1/rate values */
+    ngx_http_dogstatsd_sketch_add(e->series_pool, &series->sketch, (uint64_t) value,
+                                  STATSD_SKETCH_UNIT * STATSD_RATE_SCALE / rate);
+}
+
+static void
+ngx_http_dogstatsd_hll_add(u_char *registers, uint32_t hash)
+{
+    uint32_t    w;
+    ngx_uint_t  rank;
+
+    w = hash << STATSD_HLL_BITS;
+
+    for (rank = 1; rank <= 32 - STATSD_HLL_BITS && !(w & 0x80000000); rank++) {
+        w <<= 1;
+    }
+
+    if (registers[hash >> (32 - STATSD_HLL_BITS)] < rank) {
+        registers[hash >> (32 - STATSD_HLL_BITS)] = (u_char) rank;
+    }
+}
+
+/* natural logarithm, not worth linking with libm */
+static double
+ngx_http_dogstatsd_log(double x)
+{
+    double      y, y2, term, sum;
+    ngx_int_t   k;
+    ngx_uint_t  i;
+
+    if (x <= 0) {
+        return 0;
+    }
+
+    /* x = m * 2^k, m in [1, 2), and ln(m) = 2 atanh((m - 1) / (m + 1)) */
+
+    for (k = 0; x >= 2; k++) {
+        x /= 2;
+    }
+
+    for ( /* void */ ; x < 1; k--) {
+        x *= 2;
+    }
+
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
+    term = y;
+    sum = 0;
+
+    for (i = 1; i < 24; i += 2) {
+        sum += term / i;
+        term *= y2;
+    }
+
+    return k * 0.69314718055994531 + 2 * sum;
+}
+
+static ngx_uint_t
+ngx_http_dogstatsd_hll_count(u_char *registers)
+{
+    double      m, sum, estimate;
+    ngx_uint_t  i, zeros;
+
+    m = 1 << STATSD_HLL_BITS;
+    sum = 0;
+    zeros = 0;
+
+    for (i = 0; i < (1 << STATSD_HLL_BITS); i++) {
+        sum += 1.0 / ((uint32_t) 1 << registers[i]);
+
+        if (registers[i] == 0) {
+            zeros++;
+        }
+    }
+
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    if (estimate <= 2.5 * m && zeros) {
+        /* linear counting is more accurate for small sets */
+        estimate = m * ngx_http_dogstatsd_log(m / zeros);
+
+    } else if (estimate > 4294967296.0 / 30) {
+        /* hash collisions of 32-bit hashes, there are no more than 2^32 */
+
+        if (estimate > 4294967295.0) {
+            estimate = 4294967295.0;
+        }
+
+        estimate = -4294967296.0 * ngx_http_dogstatsd_log(1 - estimate / 4294967296.0);
+    }
+
+    return (ngx_uint_t) (estimate + 0.5);
+}
+
+static void
+ngx_http_dogstatsd_aggregate_member(ngx_udp_endpoint_t *e, ngx_str_t *key, ngx_str_t *tags,
+    ngx_str_t *member)
+{
+    uint32_t                 hash;
+    ngx_uint_t               i;
+    ngx_dogstatsd_series_t  *series;
+
+    series = ngx_http_dogstatsd_series_get(e, STATSD_TYPE_SET, key, tags, STATSD_RATE_SCALE);
+    if (series == NULL) {
+        return;
+    }
+
+    hash = ngx_murmur_hash2(member->data, member->len);
+
+    if (series->registers == NULL) {
+
+        for (i = 0; i < series->nmembers; i++) {
+            if (series->members[i] == hash) {
+                return;
+            }
+        }
+
+        if (series->nmembers < STATSD_SET_EXACT) {
+
+            if (series->members == NULL) {
+                series->members = ngx_palloc(e->series_pool,
+                                             STATSD_SET_EXACT * sizeof(uint32_t));
+                if (series->members == NULL) {
+                    return;
+                }
+            }
+
+            series->members[series->nmembers++] = hash;
+            return;
+        }
+
+        series->registers = ngx_pcalloc(e->series_pool, 1 << STATSD_HLL_BITS);
+        if (series->registers == NULL) {
+            return;
+        }
+
+        for (i = 0; i < series->nmembers; i++) {
+            ngx_http_dogstatsd_hll_add(series->registers, series->members[i]);
+        }
+    }
+
+    ngx_http_dogstatsd_hll_add(series->registers, hash);
+}
+
+/*
+ * The count of a set is only known to the worker, and sent as a gauge
+ * tagged with the worker number.
+ */
+static void
+ngx_http_dogstatsd_set_flush(ngx_udp_endpoint_t *e, ngx_dogstatsd_series_t *series)
+{
+    u_char      line[STATSD_MAX_STR], *p;
+    ngx_uint_t  count;
+
+    if (series->registers) {
+        count = ngx_http_dogstatsd_hll_count(series->registers);
+
+    } else {
+        count = series->nmembers;
+    }
+
+    if (series->tags.len == 0) {
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%ui|g|#worker:%ui",
+                         &series->key, count, ngx_worker);
+    } else {
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%ui|g|#%V,worker:%ui",
+                         &series->key, count, &series->tags, ngx_worker);
+    }
+
+    if (p == line + STATSD_MAX_STR) {
+        ngx_dogstatsd_stats.truncated++;
+    }
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+}
+
+/*
+ * The agent weighs a value sent with |@rate as 1/rate values, so
+ * a bucket holding n values is sent as its middle with a rate of 1/n.
+ */
+static void
+ngx_http_dogstatsd_sketch_flush(ngx_udp_endpoint_t *e, ngx_dogstatsd_series_t *series)
+{
+    u_char                   line[STATSD_MAX_STR], *p, *last;
+    u_char                   num[STATSD_VALUE_LEN];
+    size_t                   len;
+    ngx_uint_t               i;
+    uint64_t                 rate;
+    ngx_dogstatsd_sketch_t  *sk;
+
+    sk = &series->sketch;
+    last = line + STATSD_MAX_STR;
+
+    for (i = 0; i < sk->size; i++) {
+
+        if (sk->counts[i] == 0) {
+            continue;
+        }
+
+        len = ngx_dogstatsd_format_value(num,
+                  (int64_t) ngx_http_dogstatsd_sketch_value(sk->offset + i)) - num;
+
+        p = ngx_slprintf(line, last, "%V:%*s|%s", &series->key, len, num,
+                         ngx_http_dogstatsd_type_name(series->type));
+
+        if (sk->counts[i] != STATSD_SKETCH_UNIT) {
+            rate = (uint64_t) STATSD_SKETCH_UNIT * 100000000 / sk->counts[i];
+            p = ngx_slprintf(p, last, "|@0.%08ui", (ngx_uint_t) ngx_max(rate, 1));
+        }
+
+        if (series->tags.len) {
+            p = ngx_slprintf(p, last, "|#%V", &series->tags);
+        }
+
+        if (p == last) {
+            ngx_dogstatsd_stats.truncated++;
+        }
+
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+    }
+}
+
+/*
+ * DogStatsD 1.1 accepts several values of a series in one line,
+ * "key:v1:v2:v3|ms|@rate|#tags".
+ */
+static void
+ngx_http_dogstatsd_values_flush(ngx_udp_endpoint_t *e, ngx_dogstatsd_series_t *series)
+{
+    u_char       line[STATSD_MAX_STR], suffix[STATSD_MAX_STR], value[STATSD_VALUE_LEN + 1];
+    u_char      *p, *s, *last, *v;
+    int64_t     *values;
+    ngx_uint_t   i, n;
+
+    if (series->values == NULL) {
+        return;
+    }
+
+    s = ngx_snprintf(suffix, STATSD_MAX_STR, "|%s",
+                     ngx_http_dogstatsd_type_name(series->type));
+
+    if (series->rate < STATSD_RATE_SCALE) {
+        s = ngx_slprintf(s, suffix + STATSD_MAX_STR, "|@0.%04ui", series->rate);
+    }
+
+    if (series->tags.len) {
+        s = ngx_slprintf(s, suffix + STATSD_MAX_STR, "|#%V", &series->tags);
+    }
+
+    last = line + STATSD_MAX_STR - (s - suffix);
+    values = series->values->elts;
+
+    p = NULL;
+    n = 0;
+
+    for (i = 0; i < series->values->nelts; i++) {
+
+        value[0] = ':';
+        v = ngx_dogstatsd_format_value(value + 1, values[i]);
+
+        if (p != NULL && n > 0 && p + (v - value) > last) {
+            p = ngx_cpymem(p, suffix, s - suffix);
+            ngx_dogstatsd_buffer_line(e, line, p - line);
+            p = NULL;
+        }
+
+        if (p == NULL) {
+            p = ngx_slprintf(line, last, "%V", &series->key);
+            n = 0;
+        }
+
+        if (p + (v - value) > last) {
+            /* the key and tags leave no room for a value */
+            ngx_dogstatsd_stats.truncated++;
+            continue;
+        }
+
+        p = ngx_cpymem(p, value, v - value);
+        n++;
+    }
+
+    if (p != NULL && n > 0) {
+        p = ngx_cpymem(p, suffix, s - suffix);
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+    }
+}
+
+static void
+ngx_http_dogstatsd_inflight_update(ngx_http_dogstatsd_inflight_t *f,
+    ngx_dogstatsd_series_t *series)
+{
+    off_t                sent, received, upgraded;
+    ngx_http_request_t  *r;
+
+    r = f->request;
+
+    sent = r->connection->sent;
+    received = r->request_length;
+
+    if (sent > f->sent) {
+        series->sent += sent - f->sent;
+    }
+
+    if (received > f->received) {
+        series->received += received - f->received;
+    }
+
+    f->sent = sent;
+    f->received = received;
+
+    /*
+     * After a protocol upgrade, what the client sends goes to the upstream.
+     * The upstream connection also sent the request before, which is in
+     * the request length already, so it is counted from the first update
+     * after the upgrade.
+     */
+
+    if (r->upstream && r->upstream->upgrade && r->upstream->peer.connection) {
+        upgraded = r->upstream->peer.connection->sent;
+
+        if (f->upgraded >= 0 && upgraded > f->upgraded) {
+            series->received += upgraded - f->upgraded;
+        }
+
+        f->upgraded = upgraded;
+    }
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_inflight_handler(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_dogstatsd_conf_t       *ulcf;
+    ngx_http_dogstatsd_inflight_t   *f;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    ulcf = ngx_http_get_module_loc_conf(r, ngx_http_dogstatsd_module);
+
+    if (ulcf->inflight_key == NULL || ulcf->off == 1 || ulcf->endpoint == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * The module context is lost on internal redirects, look for
+     * a registration in the cleanups of the request pool instead.
+     */
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_dogstatsd_inflight_cleanup) {
+            return NGX_DECLINED;
+        }
+    }
+
+    /* failing to track a request must not fail the request */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_dogstatsd_inflight_t));
+    if (cln == NULL) {
+        goto failed;
+    }
+
+    f = cln->data;
+    ngx_memzero(f, sizeof(ngx_http_dogstatsd_inflight_t));
+
+    if (ngx_http_complex_value(r, ulcf->inflight_key, &f->key) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ulcf->inflight_tags
+        && ngx_http_complex_value(r, ulcf->inflight_tags, &f->tags) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    if (f->key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_escape_dogstatsd_key(f->key.data, f->key.data, f->key.len);
+
+    f->request = r;
+    f->endpoint = ulcf->endpoint;
+
+    /* keepalive connections count the bytes of the previous requests */
+    f->sent = r->connection->sent;
+    f->upgraded = -1;
+
+    ngx_queue_insert_tail(&ngx_http_dogstatsd_inflight_requests, &f->queue);
+
+    cln->handler = ngx_http_dogstatsd_inflight_cleanup;
+
+    return NGX_DECLINED;
+
+failed:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "dogstatsd: request not tracked as inflight");
+
+    return NGX_DECLINED;
+}
+
+static void
+ngx_http_dogstatsd_inflight_cleanup(void *data)
+{
+    ngx_http_dogstatsd_inflight_t  *f = data;
+
+    ngx_dogstatsd_series_t  *series;
+
+    ngx_queue_remove(&f->queue);
+
+    /* the bytes moved since the last interval are sent with the next one */
+
+    series = ngx_http_dogstatsd_series_get(f->endpoint, STATSD_TYPE_INFLIGHT, &f->key,
+                                           &f->tags, STATSD_RATE_SCALE);
+    if (series != NULL) {
+        ngx_http_dogstatsd_inflight_update(f, series);
+    }
+}
+
+static void
+ngx_http_dogstatsd_inflight_collect(void)
+{
+    ngx_queue_t                    *q;
+    ngx_dogstatsd_series_t         *series;
+    ngx_http_dogstatsd_inflight_t  *f;
+
+    for (q = ngx_queue_head(&ngx_http_dogstatsd_inflight_requests);
+         q != ngx_queue_sentinel(&ngx_http_dogstatsd_inflight_requests);
+         q = ngx_queue_next(q))
+    {
+        f = ngx_queue_data(q, ngx_http_dogstatsd_inflight_t, queue);
+
+        series = ngx_http_dogstatsd_series_get(f->endpoint, STATSD_TYPE_INFLIGHT, &f->key,
+                                               &f->tags, STATSD_RATE_SCALE);
+        if (series == NULL) {
+            continue;
+        }
+
+        series->active++;
+        ngx_http_dogstatsd_inflight_update(f, series);
+    }
+}
+
+/*
+ * The number of in-flight requests is sent as a gauge tagged with the
+ * worker number, the sum over workers is the total.
+ */
+static void
+ngx_http_dogstatsd_inflight_flush(ngx_udp_endpoint_t *e, ngx_dogstatsd_series_t *series)
+{
+    u_char  line[STATSD_MAX_STR], *p, *last;
+
+    last = line + STATSD_MAX_STR;
+
+    p = ngx_slprintf(line, last, "%V.inflight:%ui|g|#", &series->key, series->active);
+
+    if (series->tags.len) {
+        p = ngx_slprintf(p, last, "%V,", &series->tags);
+    }
+
+    p = ngx_slprintf(p, last, "worker:%ui", ngx_worker);
+
+    if (p == last) {
+        ngx_dogstatsd_stats.truncated++;
+    }
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+
+    if (series->sent) {
+        p = ngx_slprintf(line, last, "%V.bytes_sent:%O|c", &series->key, series->sent);
+
+        if (series->tags.len) {
+            p = ngx_slprintf(p, last, "|#%V", &series->tags);
+        }
+
+        if (p == last) {
+            ngx_dogstatsd_stats.truncated++;
+        }
+
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+    }
+
+    if (series->received) {
+        p = ngx_slprintf(line, last, "%V.bytes_received:%O|c", &series->key, series->received);
+
+        if (series->tags.len) {
+            p = ngx_slprintf(p, last, "|#%V", &series->tags);
+        }
+
+        if (p == last) {
+            ngx_dogstatsd_stats.truncated++;
+        }
+
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+    }
+}
+
+static void
+ngx_http_dogstatsd_aggregate_flush(ngx_udp_endpoint_t *e)
+{
+    ngx_rbtree_node_t       *node;
+    ngx_dogstatsd_series_t  *series;
+
+    if (e->series_pool == NULL) {
+        return;
+    }
+
+    if (e->series.root != e->series.sentinel) {
+        for (node = ngx_rbtree_min(e->series.root, e->series.sentinel);
+             node;
+             node = ngx_rbtree_next(&e->series, node))
+        {
+            series = (ngx_dogstatsd_series_t *) node;
+
+            if (series->type == STATSD_TYPE_TIMING) {
+                ngx_http_dogstatsd_values_flush(e, series);
+
+            } else if (series->type == STATSD_TYPE_SET) {
+                ngx_http_dogstatsd_set_flush(e, series);
+
+            } else if (series->type == STATSD_TYPE_INFLIGHT) {
+                ngx_http_dogstatsd_inflight_flush(e, series);
+
+            } else {
+                ngx_http_dogstatsd_sketch_flush(e, series);
+            }
+        }
+    }
+
+    ngx_dogstatsd_buffer_flush(e);
+
+    if (e->series_dropped) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dogstatsd: too many series, %ui values dropped",
+                      e->series_dropped);
+        e->series_dropped = 0;
+    }
+
+    ngx_destroy_pool(e->series_pool);
+    e->series_pool = NULL;
+}
+
+static void
+ngx_http_dogstatsd_aggregate_flush_all(ngx_http_dogstatsd_main_conf_t *umcf)
+{
+    ngx_udp_endpoint_t  **e;
+    ngx_uint_t            i;
+
+    if (umcf->endpoints == NULL) {
+        return;
+    }
+
+    ngx_http_dogstatsd_inflight_collect();
+
+    e = umcf->endpoints->elts;
+    for (i = 0; i < umcf->endpoints->nelts; i++) {
+        ngx_http_dogstatsd_aggregate_flush(e[i]);
+    }
+
+    if (umcf->error_log_prefix.len) {
+        ngx_http_dogstatsd_error_log_flush(umcf);
+    }
+}
+
+static void
+ngx_http_dogstatsd_aggregate_handler(ngx_event_t *ev)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    umcf = ev->data;
+
+    ngx_http_dogstatsd_aggregate_flush_all(umcf);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, umcf->aggregate_interval);
+}
+
+/*
+ * Starts sending the series collected by the worker, when a directive or
+ * the first call of the API that collects values needs it.
+ */
+static void
+ngx_http_dogstatsd_aggregate_start(ngx_http_dogstatsd_main_conf_t *umcf, ngx_log_t *log)
+{
+    ngx_event_t  *ev;
+
+    umcf->aggregate = 1;
+
+    ev = &ngx_http_dogstatsd_aggregate_event;
+
+    /* values collected while exiting are sent by exit_process */
+    if (ev->timer_set || ngx_exiting) {
+        return;
+    }
+
+    ev->handler = ngx_http_dogstatsd_aggregate_handler;
+    ev->data = umcf;
+    ev->log = log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, umcf->aggregate_interval);
+}
+
+static void
+ngx_http_dogstatsd_internal_gauge(ngx_udp_endpoint_t *e, char *key, ngx_uint_t value,
+    ngx_str_t *tags)
+{
+    u_char  line[STATSD_MAX_STR], *p;
+
+    if (tags->len == 0) {
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%s:%ui|g", key, value);
+    } else {
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%s:%ui|g|#%V", key, value, tags);
+    }
+
+    if (p == line + STATSD_MAX_STR) {
+        ngx_dogstatsd_stats.truncated++;
+    }
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+}
+
+static void
+ngx_http_dogstatsd_internal_metrics_handler(ngx_event_t *ev)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+    ngx_udp_endpoint_t              *e;
+    ngx_uint_t                       i;
+    ngx_list_part_t                 *part;
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_str_t                        tags;
+    u_char                           buf[STATSD_MAX_STR], *p;
+#if defined nginx_version && nginx_version >= 1011007
+    ngx_slab_pool_t                 *shpool;
+#endif
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    umcf = ev->data;
+    e = umcf->endpoint;
+
+#if (NGX_STAT_STUB)
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.net.connections",
+                                      *ngx_stat_active, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.net.reading",
+                                      *ngx_stat_reading, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.net.writing",
+                                      *ngx_stat_writing, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.net.waiting",
+                                      *ngx_stat_waiting, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.connections.accepted",
+                                      *ngx_stat_accepted, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.connections.handled",
+                                      *ngx_stat_handled, &umcf->internal_tags);
+    ngx_http_dogstatsd_internal_gauge(e, "nginx.requests.total",
+                                      *ngx_stat_requests, &umcf->internal_tags);
+#endif
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (umcf->internal_tags.len == 0) {
+            p = ngx_snprintf(buf, STATSD_MAX_STR, "zone:%V", &shm_zone[i].shm.name);
+        } else {
+            p = ngx_snprintf(buf, STATSD_MAX_STR, "zone:%V,%V", &shm_zone[i].shm.name,
+                             &umcf->internal_tags);
+        }
+
+        tags.data = buf;
+        tags.len = p - buf;
+
+        ngx_http_dogstatsd_internal_gauge(e, "nginx.shm.size", shm_zone[i].shm.size, &tags);
+
+#if defined nginx_version && nginx_version >= 1011007
+        /* pfree is read without the zone mutex, a stale value is good enough here */
+        shpool = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+        if (shpool != NULL) {
+            ngx_http_dogstatsd_internal_gauge(e, "nginx.shm.free",
+                                              shpool->pfree * ngx_pagesize, &tags);
+        }
+#endif
+    }
+
+    ngx_dogstatsd_buffer_flush(e);
+
+    ngx_add_timer(ev, umcf->internal_interval);
+}
+
+static void
+ngx_http_dogstatsd_client_metric(ngx_udp_endpoint_t *e, char *key, ngx_uint_t value,
+    ngx_str_t *tags)
+{
+    u_char  line[STATSD_MAX_STR], *p;
+
+    if (value == 0) {
+        return;
+    }
+
+    p = ngx_snprintf(line, STATSD_MAX_STR, "%s:%ui|c|#%V", key, value, tags);
+
+    if (p == line + STATSD_MAX_STR) {
+        ngx_dogstatsd_stats.truncated++;
+    }
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+}
+
+static void
+ngx_http_dogstatsd_client_metrics_handler(ngx_event_t *ev)
+{
+    ngx_http_dogstatsd_main_conf_t      *umcf;
+    ngx_http_dogstatsd_client_metric_t  *m;
+    ngx_dogstatsd_stats_t           now, *last;
+    ngx_udp_endpoint_t                  *e;
+    ngx_uint_t                           i, value;
+    ngx_str_t                            tags;
+    u_char                               buf[STATSD_MAX_STR], *p;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    umcf = ev->data;
+    e = umcf->endpoint;
+
+    /* the lines sent below are accounted for in the next interval */
+    now = ngx_dogstatsd_stats;
+    last = &ngx_http_dogstatsd_stats_sent;
+
+    if (umcf->client_tags.len == 0) {
+        p = ngx_snprintf(buf, STATSD_MAX_STR, "client:nginx,worker:%ui", ngx_worker);
+    } else {
+        p = ngx_snprintf(buf, STATSD_MAX_STR, "client:nginx,worker:%ui,%V", ngx_worker,
+                         &umcf->client_tags);
+    }
+
+    tags.data = buf;
+    tags.len = p - buf;
+
+    for (m = ngx_http_dogstatsd_client_metrics; m->name; m++) {
+        value = *(ngx_uint_t *) ((u_char *) &now + m->offset)
+                - *(ngx_uint_t *) ((u_char *) last + m->offset);
+
+        ngx_http_dogstatsd_client_metric(e, m->name, value, &tags);
+    }
+
+    for (i = 0; i < STATSD_ERR_MAX; i++) {
+        value = now.errors[i] - last->errors[i];
+        if (value == 0) {
+            continue;
+        }
+
+        if (umcf->client_tags.len == 0) {
+            p = ngx_snprintf(buf, STATSD_MAX_STR, "client:nginx,worker:%ui,error:%V",
+                             ngx_worker, &ngx_http_dogstatsd_errors[i]);
+        } else {
+            p = ngx_snprintf(buf, STATSD_MAX_STR, "client:nginx,worker:%ui,error:%V,%V",
+                             ngx_worker, &ngx_http_dogstatsd_errors[i], &umcf->client_tags);
+        }
+
+        tags.len = p - buf;
+
+        ngx_http_dogstatsd_client_metric(e, "datadog.dogstatsd.client.packets_dropped",
+                                         value, &tags);
+    }
+
+    *last = now;
+
+    ngx_dogstatsd_buffer_flush(e);
+
+    ngx_add_timer(ev, umcf->client_interval);
+}
+
+/*
+ * Counts a message of a hooked error_log.  The writer belongs to a log of
+ * its own, inserted in the chain after the hooked log, so that the hooked
+ * log is written as if it was not hooked: its own writer, e.g. syslog,
+ * may log its errors to the same log, and nginx still knows whether the
+ * message went to stderr.
+ */
+static void
+ngx_http_dogstatsd_log_writer(ngx_log_t *log, ngx_uint_t level, u_char *buf, size_t len)
+{
+    ngx_uint_t                       i;
+    ngx_http_dogstatsd_log_class_t  *c;
+
+    if (level <= NGX_LOG_DEBUG) {
+        ngx_http_dogstatsd_log_levels[level]++;
+    }
+
+    if (level <= NGX_LOG_ERR) {
+        for (c = ngx_http_dogstatsd_log_classes, i = 0; c->text; c++, i++) {
+            if (ngx_strnstr(buf, c->text, len)) {
+                ngx_http_dogstatsd_log_counts[i]++;
+            }
+        }
+    }
+}
+
+/*
+ * Messages are dispatched to the first log of a chain and then to the
+ * next ones with a lower or the same level, only the first logs are
+ * followed by a counting log to count each message once.
+ */
+static ngx_int_t
+ngx_http_dogstatsd_log_hook(ngx_cycle_t *cycle, ngx_log_t *log)
+{
+    ngx_http_dogstatsd_log_hook_t  *hook;
+
+    if (log == NULL
+        || (log->next && log->next->writer == ngx_http_dogstatsd_log_writer))
+    {
+        return NGX_OK;
+    }
+
+    hook = ngx_pcalloc(cycle->pool, sizeof(ngx_http_dogstatsd_log_hook_t));
+    if (hook == NULL) {
+        return NGX_ERROR;
+    }
+
+    hook->counter.log_level = log->log_level;
+    hook->counter.writer = ngx_http_dogstatsd_log_writer;
+    hook->counter.next = log->next;
+
+    hook->log = log;
+    hook->next = ngx_http_dogstatsd_log_hooks;
+
+    ngx_http_dogstatsd_log_hooks = hook;
+
+    log->next = &hook->counter;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_log_hook_tree(ngx_cycle_t *cycle, ngx_http_location_tree_node_t *node)
+{
+    if (node == NULL) {
+        return NGX_OK;
+    }
+
+    if (node->exact && ngx_http_dogstatsd_log_hook_location(cycle, node->exact) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (node->inclusive
+        && ngx_http_dogstatsd_log_hook_location(cycle, node->inclusive) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_dogstatsd_log_hook_tree(cycle, node->left) != NGX_OK
+        || ngx_http_dogstatsd_log_hook_tree(cycle, node->right) != NGX_OK
+        || ngx_http_dogstatsd_log_hook_tree(cycle, node->tree) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_log_hook_location(ngx_cycle_t *cycle, ngx_http_core_loc_conf_t *clcf)
+{
+#if (NGX_PCRE)
+    ngx_http_core_loc_conf_t  **clcfp;
+#endif
+
+    if (ngx_http_dogstatsd_log_hook(cycle, clcf->error_log) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
-                   "cleanup dogstatsd_updater");
+    if (ngx_http_dogstatsd_log_hook_tree(cycle, clcf->static_locations) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    if(e->udp_connection) {
-        if(e->udp_connection->udp) {
-            ngx_close_connection(e->udp_connection->udp);
+#if (NGX_PCRE)
+    if (clcf->regex_locations) {
+        for (clcfp = clcf->regex_locations; *clcfp; clcfp++) {
+            if (ngx_http_dogstatsd_log_hook_location(cycle, *clcfp) != NGX_OK) {
+                return NGX_ERROR;
+            }
         }
-
-        ngx_free(e->udp_connection);
     }
-}
+#endif
 
-static void ngx_http_dogstatsd_udp_dummy_handler(ngx_event_t *ev)
-{
+    return NGX_OK;
 }
 
+/*
+ * Hooks the logs of the cycle, of the listening sockets, which connections
+ * copy, and of every location, which requests copy when they enter it.
+ */
 static ngx_int_t
-ngx_http_dogstatsd_udp_connect(ngx_resolver_connection_t *rec)
+ngx_http_dogstatsd_error_log_init(ngx_cycle_t *cycle)
 {
-    int                rc;
-    ngx_int_t          event;
-    ngx_event_t       *rev, *wev;
-    ngx_socket_t       s;
-    ngx_connection_t  *c;
+    ngx_uint_t                   i;
+    ngx_listening_t             *ls;
+    ngx_http_core_loc_conf_t    *clcf, **clcfp;
+    ngx_http_core_srv_conf_t   **cscfp;
+    ngx_http_core_main_conf_t   *cmcf;
 
-    s = ngx_socket(rec->sockaddr->sa_family, SOCK_DGRAM, 0);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, &rec->log, 0, "UDP socket %d", s);
-
-    if (s == (ngx_socket_t) -1) {
-        ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
-                      ngx_socket_n " failed");
+    if (ngx_http_dogstatsd_log_hook(cycle, cycle->log) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    c = ngx_get_connection(s, &rec->log);
-
-    if (c == NULL) {
-        if (ngx_close_socket(s) == -1) {
-            ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
-                          ngx_close_socket_n "failed");
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+        if (ngx_http_dogstatsd_log_hook(cycle, &ls[i].log) != NGX_OK) {
+            return NGX_ERROR;
         }
-
-        return NGX_ERROR;
     }
 
-    if (ngx_nonblocking(s) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, &rec->log, ngx_socket_errno,
-                      ngx_nonblocking_n " failed");
-
-        goto failed;
-    }
+    cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
 
-    rev = c->read;
-    wev = c->write;
+    cscfp = cmcf->servers.elts;
+    for (i = 0; i < cmcf->servers.nelts; i++) {
+        clcf = cscfp[i]->ctx->loc_conf[ngx_http_core_module.ctx_index];
 
-    rev->log = &rec->log;
-    wev->log = &rec->log;
+        if (ngx_http_dogstatsd_log_hook_location(cycle, clcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    rec->udp = c;
+        if (cscfp[i]->named_locations) {
+            for (clcfp = cscfp[i]->named_locations; *clcfp; clcfp++) {
+                if (ngx_http_dogstatsd_log_hook_location(cycle, *clcfp) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+        }
+    }
 
-    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    return NGX_OK;
+}
 
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, &rec->log, 0,
-                   "connect to %V, fd:%d #%uA", &rec->server, s, c->number);
+/*
+ * The cycle pool holding the hooks is destroyed after exit_process, while
+ * nginx still logs, so the counting logs are unlinked.
+ */
+static void
+ngx_http_dogstatsd_error_log_done(void)
+{
+    ngx_http_dogstatsd_log_hook_t  *hook;
 
-    rc = connect(s, rec->sockaddr, rec->socklen);
+    for (hook = ngx_http_dogstatsd_log_hooks; hook; hook = hook->next) {
+        hook->log->next = hook->counter.next;
+    }
 
-    /* TODO: iocp */
+    ngx_http_dogstatsd_log_hooks = NULL;
+}
 
-    if (rc == -1) {
-        ngx_log_error(NGX_LOG_CRIT, &rec->log, ngx_socket_errno,
-                      "connect() failed");
+static void
+ngx_http_dogstatsd_error_log_flush(ngx_http_dogstatsd_main_conf_t *umcf)
+{
+    u_char                           line[STATSD_MAX_STR], *p;
+    ngx_uint_t                       i;
+    ngx_udp_endpoint_t              *e;
+    ngx_http_dogstatsd_log_class_t  *c;
 
-        goto failed;
-    }
+    e = umcf->endpoint;
 
-    /* UDP sockets are always ready to write */
-    wev->ready = 1;
+    for (i = 0; i <= NGX_LOG_DEBUG; i++) {
+        if (ngx_http_dogstatsd_log_levels[i] == 0) {
+            continue;
+        }
 
-    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
-                /* kqueue, epoll */                 NGX_CLEAR_EVENT:
-                /* select, poll, /dev/poll */       NGX_LEVEL_EVENT;
-                /* eventport event type has no meaning: oneshot only */
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%V:%ui|c|#level:%V",
+                         &umcf->error_log_prefix, ngx_http_dogstatsd_log_levels[i],
+                         &ngx_http_dogstatsd_log_level_names[i]);
 
-    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
-        goto failed;
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+        ngx_http_dogstatsd_log_levels[i] = 0;
     }
 
-    return NGX_OK;
+    for (c = ngx_http_dogstatsd_log_classes, i = 0; c->text; c++, i++) {
+        if (ngx_http_dogstatsd_log_counts[i] == 0) {
+            continue;
+        }
 
-failed:
+        p = ngx_snprintf(line, STATSD_MAX_STR, "%V.%V:%ui|c",
+                         &umcf->error_log_prefix, &c->name,
+                         ngx_http_dogstatsd_log_counts[i]);
 
-    ngx_close_connection(c);
-    rec->udp = NULL;
+        ngx_dogstatsd_buffer_line(e, line, p - line);
+        ngx_http_dogstatsd_log_counts[i] = 0;
+    }
 
-    return NGX_ERROR;
+    ngx_dogstatsd_buffer_flush(e);
 }
 
 static ngx_int_t
-ngx_http_dogstatsd_udp_send(ngx_udp_endpoint_t *l, u_char *buf, size_t len)
+ngx_http_dogstatsd_init_process(ngx_cycle_t *cycle)
 {
-    ssize_t                n;
-    ngx_resolver_connection_t  *rec;
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+    ngx_event_t                     *ev;
 
-    rec = l->udp_connection;
-    if (rec->udp == NULL) {
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
 
-        rec->log = *l->log;
-        rec->log.handler = NULL;
-        rec->log.data = NULL;
-        rec->log.action = "logging";
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_dogstatsd_module);
+    if (umcf == NULL || umcf->endpoints == NULL) {
+        return NGX_OK;
+    }
 
-        if(ngx_http_dogstatsd_udp_connect(rec) != NGX_OK) {
-            if(rec->udp != NULL) {
-                ngx_free_connection(rec->udp);
-                rec->udp = NULL;
-            }
+    /* nginx counters are shared by all workers, one of them is enough */
+    if (umcf->internal_interval != NGX_CONF_UNSET_MSEC && ngx_worker == 0) {
+        ev = &ngx_http_dogstatsd_internal_event;
 
-            return NGX_ERROR;
-        }
+        ev->handler = ngx_http_dogstatsd_internal_metrics_handler;
+        ev->data = umcf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
 
-        rec->udp->data = l;
-        rec->udp->read->handler = ngx_http_dogstatsd_udp_dummy_handler;
-        rec->udp->read->resolver = 0;
+        ngx_add_timer(ev, umcf->internal_interval);
     }
 
-    n = ngx_send(rec->udp, buf, len);
+    if (umcf->client_interval != NGX_CONF_UNSET_MSEC) {
+        ev = &ngx_http_dogstatsd_client_event;
 
-    if (n == -1) {
-        return NGX_ERROR;
+        ev->handler = ngx_http_dogstatsd_client_metrics_handler;
+        ev->data = umcf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, umcf->client_interval);
     }
 
-    if ((size_t) n != (size_t) len) {
-#if defined nginx_version && nginx_version >= 8032
-        ngx_log_error(NGX_LOG_CRIT, &rec->log, 0, "send() incomplete");
-#else
-        ngx_log_error(NGX_LOG_CRIT, rec->log, 0, "send() incomplete");
-#endif
+    if (umcf->error_log_prefix.len
+        && ngx_http_dogstatsd_error_log_init(cycle) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
+    if (umcf->aggregate) {
+        ngx_http_dogstatsd_aggregate_start(umcf, cycle->log);
+    }
+
     return NGX_OK;
 }
 
+static void
+ngx_http_dogstatsd_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_dogstatsd_module);
+    if (umcf == NULL) {
+        return;
+    }
+
+    /* do not lose the values of the last interval */
+    ngx_http_dogstatsd_aggregate_flush_all(umcf);
+
+    ngx_http_dogstatsd_error_log_done();
+}
+
 static void *
 ngx_http_dogstatsd_create_main_conf(ngx_conf_t *cf)
 {
@@ -508,6 +2216,11 @@ ngx_http_dogstatsd_create_main_conf(ngx_conf_t *cf)
     if (conf == NULL) {
         return NGX_CONF_ERROR;
     }
+    conf->internal_interval = NGX_CONF_UNSET_MSEC;
+    conf->client_interval = NGX_CONF_UNSET_MSEC;
+    conf->rate_budget = NGX_CONF_UNSET_UINT;
+    conf->aggregate_interval = NGX_CONF_UNSET_MSEC;
+    conf->pack_timings = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -525,6 +2238,8 @@ ngx_http_dogstatsd_create_loc_conf(ngx_conf_t *cf)
     conf->off = NGX_CONF_UNSET;
 	conf->sample_rate = NGX_CONF_UNSET_UINT;
 	conf->stats = NULL;
+	conf->inflight_key = NGX_CONF_UNSET_PTR;
+	conf->inflight_tags = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -544,6 +2259,17 @@ ngx_http_dogstatsd_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_off_value(conf->off, prev->off, 1);
 	ngx_conf_merge_uint_value(conf->sample_rate, prev->sample_rate, 100);
 
+	if (conf->sample_rate > 100) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+						   "\"dogstatsd_sample_rate\" must be at most 100");
+		return NGX_CONF_ERROR;
+	}
+
+	if (conf->inflight_key == NGX_CONF_UNSET_PTR) {
+		conf->inflight_key = (prev->inflight_key == NGX_CONF_UNSET_PTR) ? NULL : prev->inflight_key;
+		conf->inflight_tags = (prev->inflight_tags == NGX_CONF_UNSET_PTR) ? NULL : prev->inflight_tags;
+	}
+
 	if (conf->stats == NULL) {
 		sz = (prev->stats != NULL ? prev->stats->nelts : 2);
 		conf->stats = ngx_array_create(cf->pool, sz, sizeof(ngx_dogstatsd_stat_t));
@@ -562,6 +2288,7 @@ ngx_http_dogstatsd_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 			stat->type = prev_stat.type;
 			stat->key = prev_stat.key;
 			stat->metric = prev_stat.metric;
+			stat->member = prev_stat.member;
 			stat->tags = prev_stat.tags;
 			stat->ckey = prev_stat.ckey;
 			stat->cmetric = prev_stat.cmetric;
@@ -579,68 +2306,38 @@ ngx_http_dogstatsd_add_endpoint(ngx_conf_t *cf, ngx_dogstatsd_addr_t *peer_addr)
 {
     ngx_http_dogstatsd_main_conf_t    *umcf;
     ngx_udp_endpoint_t             *endpoint;
+    ngx_udp_endpoint_t            **ep;
 
     umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_dogstatsd_module);
 
     if(umcf->endpoints == NULL) {
-        umcf->endpoints = ngx_array_create(cf->pool, 2, sizeof(ngx_udp_endpoint_t));
+        umcf->endpoints = ngx_array_create(cf->pool, 2, sizeof(ngx_udp_endpoint_t *));
         if (umcf->endpoints == NULL) {
             return NULL;
         }
     }
 
-    endpoint = ngx_array_push(umcf->endpoints);
+    /*
+     * Endpoints are allocated one by one: locations keep pointers to them,
+     * which must stay valid when the array grows.
+     */
+    endpoint = ngx_pcalloc(cf->pool, sizeof(ngx_udp_endpoint_t));
     if (endpoint == NULL) {
         return NULL;
     }
 
-    endpoint->peer_addr = *peer_addr;
-
-    return endpoint;
-}
-
-static ngx_str_t *
-ngx_http_dogstatsd_get_env_value(ngx_conf_t *cf, ngx_str_t *value)
-{
-    char        *env_value;
-    size_t      env_len;
-    u_char      *p;
-    char        *env_name;
-
-    if (!(value->len > 1 && value->data[0] == '$')) {
-        return value;
-    }
-
-    /* Create a null-terminated string for getenv() */
-    env_name = ngx_palloc(cf->pool, value->len);
-    if (env_name == NULL) {
+    ep = ngx_array_push(umcf->endpoints);
+    if (ep == NULL) {
         return NULL;
     }
-    ngx_memcpy(env_name, value->data + 1, value->len - 1);
-    env_name[value->len - 1] = '\0';
 
-    env_value = getenv(env_name);
-    if (env_value == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "environment variable \"%V\" not found", value);
-        return NULL;
-    }
-    env_len = strlen(env_value);
-    if (env_len == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "environment variable \"%V\" is empty", value);
-        return NULL;
-    }
+    *ep = endpoint;
 
-    /* Allocate memory and copy the environment variable value including null terminator */
-    p = ngx_palloc(cf->pool, env_len + 1);
-    if (p == NULL) {
-        return NULL;
+    if (peer_addr) {
+        endpoint->peer_addr = *peer_addr;
     }
-    ngx_memcpy(p, env_value, env_len);
-    p[env_len] = '\0';
-    value->data = p;
-    value->len = env_len;
 
-    return value;
+    return endpoint;
 }
 
 static char *
@@ -659,7 +2356,22 @@ ngx_http_dogstatsd_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ulcf->off = 0;
 
     /* Handle environment variable if present */
-    if (ngx_http_dogstatsd_get_env_value(cf, &value[1]) == NULL) {
+    if (ngx_dogstatsd_get_env_value(cf, &value[1]) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len >= 5 && ngx_strncmp(value[1].data, "file:", 5) == 0) {
+        ulcf->endpoint = ngx_http_dogstatsd_add_endpoint(cf, NULL);
+        if(ulcf->endpoint == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return ngx_dogstatsd_set_file(cf, ulcf->endpoint, &value[1],
+                                      cf->args->nelts > 2 ? &value[2] : NULL);
+    }
+
+    if (cf->args->nelts > 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
@@ -685,6 +2397,7 @@ ngx_http_dogstatsd_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static char *
 ngx_http_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf, ngx_uint_t type) {
     ngx_http_dogstatsd_conf_t      		*ulcf = conf;
+    ngx_http_dogstatsd_main_conf_t		*umcf;
 	ngx_http_complex_value_t			key_cv;
 	ngx_http_compile_complex_value_t    key_ccv;
 	ngx_http_complex_value_t			metric_cv;
@@ -695,7 +2408,7 @@ ngx_http_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf, ngx_
 	ngx_http_compile_complex_value_t    valid_ccv;
     ngx_str_t                   		*value;
 	ngx_dogstatsd_stat_t 					*stat;
-	ngx_int_t							n;
+	int64_t							n;
 	ngx_str_t							s;
 	ngx_flag_t							b;
 
@@ -718,6 +2431,11 @@ ngx_http_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf, ngx_
 	stat->type = type;
 	stat->valid = 1;
 
+	if (type & STATSD_TYPE_AGGREGATED) {
+		umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_dogstatsd_module);
+		umcf->aggregate = 1;
+	}
+
 	ngx_memzero(&key_ccv, sizeof(ngx_http_compile_complex_value_t));
 	key_ccv.cf = cf;
 	key_ccv.value = &value[1];
@@ -751,13 +2469,15 @@ ngx_http_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf, ngx_
 		return NGX_CONF_ERROR;
 	}
 
-	if (metric_cv.lengths == NULL) {
-		n = ngx_http_dogstatsd_metric_value(&value[2]);
-		if (n < 0) {
+	if (metric_cv.lengths == NULL && type == STATSD_TYPE_SET) {
+		stat->member = value[2];
+	} else if (metric_cv.lengths == NULL) {
+		n = ngx_dogstatsd_metric_value(&value[2], type & STATSD_TYPE_MSEC);
+		if (n == STATSD_VALUE_INVALID || ((type & STATSD_TYPE_MSEC) && n < 0)) {
 			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
 			return NGX_CONF_ERROR;
 		};
-		stat->metric = (ngx_uint_t) n;
+		stat->metric = n;
 	} else {
 		stat->cmetric = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
 		if (stat->cmetric == NULL) {
@@ -833,6 +2553,237 @@ ngx_http_dogstatsd_add_timing(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 	return ngx_http_dogstatsd_add_stat(cf, cmd, conf, STATSD_TYPE_TIMING);
 }
 
+static char *
+ngx_http_dogstatsd_add_distribution(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	return ngx_http_dogstatsd_add_stat(cf, cmd, conf, STATSD_TYPE_DISTRIBUTION);
+}
+
+static char *
+ngx_http_dogstatsd_add_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	return ngx_http_dogstatsd_add_stat(cf, cmd, conf, STATSD_TYPE_HISTOGRAM);
+}
+
+static char *
+ngx_http_dogstatsd_add_gauge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	return ngx_http_dogstatsd_add_stat(cf, cmd, conf, STATSD_TYPE_GAUGE);
+}
+
+static char *
+ngx_http_dogstatsd_add_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	return ngx_http_dogstatsd_add_stat(cf, cmd, conf, STATSD_TYPE_SET);
+}
+
+static char *
+ngx_http_dogstatsd_check_interval(ngx_conf_t *cf, void *post, void *data)
+{
+    ngx_msec_t  *interval = data;
+
+    if (*interval == 0) {
+        return "must be greater than 0";
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_dogstatsd_check_budget(ngx_conf_t *cf, void *post, void *data)
+{
+    ngx_uint_t  *budget = data;
+
+    if (*budget == 0) {
+        return "must be greater than 0";
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_dogstatsd_set_internal_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf = conf;
+    ngx_str_t                       *value;
+    ngx_msec_t                       interval;
+
+    if (umcf->internal_interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    interval = ngx_parse_time(&value[1], 0);
+    if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid interval \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    umcf->internal_interval = interval;
+
+    if (cf->args->nelts > 2) {
+        umcf->internal_tags = value[2];
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_dogstatsd_set_client_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf = conf;
+    ngx_str_t                       *value;
+    ngx_msec_t                       interval;
+
+    if (umcf->client_interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    interval = ngx_parse_time(&value[1], 0);
+    if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid interval \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    umcf->client_interval = interval;
+
+    if (cf->args->nelts > 2) {
+        umcf->client_tags = value[2];
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_dogstatsd_set_error_log_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dogstatsd_main_conf_t  *umcf = conf;
+    ngx_str_t                       *value;
+
+    if (umcf->error_log_prefix.len) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts > 1) {
+        if (value[1].len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty prefix");
+            return NGX_CONF_ERROR;
+        }
+
+        umcf->error_log_prefix = value[1];
+
+    } else {
+        ngx_str_set(&umcf->error_log_prefix, "nginx.error_log");
+    }
+
+    umcf->aggregate = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_dogstatsd_set_inflight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dogstatsd_conf_t         *ulcf = conf;
+    ngx_http_dogstatsd_main_conf_t    *umcf;
+    ngx_str_t                         *value;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (ulcf->inflight_key != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ulcf->inflight_tags = NULL;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ulcf->inflight_key = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ulcf->inflight_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (ulcf->inflight_key == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = ulcf->inflight_key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts > 2) {
+        ulcf->inflight_tags = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (ulcf->inflight_tags == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+        ccv.cf = cf;
+        ccv.value = &value[2];
+        ccv.complex_value = ulcf->inflight_tags;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_dogstatsd_module);
+    umcf->inflight = 1;
+    umcf->aggregate = 1;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_dogstatsd_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_dogstatsd_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui",
+                         *(ngx_uint_t *) ((u_char *) &ngx_dogstatsd_stats + data))
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 static ngx_int_t
 ngx_http_dogstatsd_init(ngx_conf_t *cf)
 {
@@ -841,14 +2792,16 @@ ngx_http_dogstatsd_init(ngx_conf_t *cf)
     ngx_http_core_main_conf_t    *cmcf;
     ngx_http_dogstatsd_main_conf_t  *umcf;
     ngx_http_handler_pt          *h;
-    ngx_udp_endpoint_t           *e;
+    ngx_udp_endpoint_t          **e;
+    ngx_http_dogstatsd_conf_t    *ulcf;
 
     umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_dogstatsd_module);
+    ulcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_dogstatsd_module);
 
     if(umcf->endpoints != NULL) {
         e = umcf->endpoints->elts;
         for(i = 0;i < umcf->endpoints->nelts;i++) {
-            rc = ngx_dogstatsd_init_endpoint(cf, e + i);
+            rc = ngx_dogstatsd_init_endpoint(cf, e[i]);
 
             if(rc != NGX_OK) {
                 return NGX_ERROR;
@@ -863,70 +2816,49 @@ ngx_http_dogstatsd_init(ngx_conf_t *cf)
         }
 
         *h = ngx_http_dogstatsd_handler;
-    }
-
-    return NGX_OK;
-}
-
-uintptr_t
-ngx_escape_dogstatsd_key(u_char *dst, u_char *src, size_t size)
-{
-    ngx_uint_t      n;
-    uint32_t       *escape;
-
-                    /* " ", "#", """, "%", "'", %00-%1F, %7F-%FF */
-
-    static uint32_t   statsd_key[] = {
-        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
-
-                    /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
-		0xfc00bfff, /* 1111 1100 0000 0000  1011 1111 1111 1111 */
-
-                    /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
-		0x78000001, /* 0111 1000 0000 0000  0000 0000 0000 0001 */
-
-                    /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
-		0xf8000001, /* 1111 1000 0000 0000  0000 0000 0000 0001 */
-
-        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
-        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
-        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
-        0xffffffff  /* 1111 1111 1111 1111  1111 1111 1111 1111 */
-    };
-
-    static uint32_t  *map[] =
-        { statsd_key };
 
+        if (umcf->inflight) {
+            h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+            if (h == NULL) {
+                return NGX_ERROR;
+            }
 
-    escape = map[0];
-
-    if (dst == NULL) {
+            *h = ngx_http_dogstatsd_inflight_handler;
+        }
 
-        /* find the number of the characters to be escaped */
+        /* the worker metrics go to the server of the http block only */
+        if (ulcf->off != 1 && ulcf->endpoint != NGX_CONF_UNSET_PTR) {
+            umcf->endpoint = ulcf->endpoint;
+        }
+    }
 
-        n = 0;
+    if (umcf->internal_interval != NGX_CONF_UNSET_MSEC && umcf->endpoint == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"dogstatsd_internal_metrics\" requires \"dogstatsd_server\" "
+                           "in the \"http\" block");
+        return NGX_ERROR;
+    }
 
-        while (size) {
-            if (escape[*src >> 5] & (1 << (*src & 0x1f))) {
-                n++;
-            }
-            src++;
-            size--;
-        }
+    ngx_conf_init_msec_value(umcf->aggregate_interval, 10000);
+    ngx_conf_init_value(umcf->pack_timings, 0);
 
-        return (uintptr_t) n;
+    if (umcf->pack_timings) {
+        umcf->aggregate = 1;
     }
 
-    while (size) {
-        if (escape[*src >> 5] & (1 << (*src & 0x1f))) {
-            *dst++ = '_';
-            src++;
+    if (umcf->client_interval != NGX_CONF_UNSET_MSEC && umcf->endpoint == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"dogstatsd_client_metrics\" requires \"dogstatsd_server\" "
+                           "in the \"http\" block");
+        return NGX_ERROR;
+    }
 
-        } else {
-            *dst++ = *src++;
-        }
-        size--;
+    if (umcf->error_log_prefix.len && umcf->endpoint == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"dogstatsd_error_log_metrics\" requires \"dogstatsd_server\" "
+                           "in the \"http\" block");
+        return NGX_ERROR;
     }
 
-    return (uintptr_t) dst;
+    return NGX_OK;
 }
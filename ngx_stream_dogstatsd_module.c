@@ -0,0 +1,657 @@
+/*
+ * nginx-dogstatsd module
+ * Copyright (C) 2017 Matt Robenolt
+ *
+ * Sends the metrics of stream (TCP/UDP) sessions in the log phase.
+ */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include "ngx_dogstatsd.h"
+
+#define STATSD_TYPE_COUNTER	0x0001
+#define STATSD_TYPE_TIMING  0x0002
+#define STATSD_TYPE_GAUGE   0x0004
+
+
+typedef struct {
+    ngx_array_t                  *endpoints;
+} ngx_stream_dogstatsd_main_conf_t;
+
+typedef struct {
+    ngx_uint_t                    type;
+
+    ngx_str_t                     key;
+    int64_t                       metric;
+    ngx_str_t                     tags;
+    ngx_flag_t                    valid;
+
+    ngx_stream_complex_value_t   *ckey;
+    ngx_stream_complex_value_t   *cmetric;
+    ngx_stream_complex_value_t   *ctags;
+    ngx_stream_complex_value_t   *cvalid;
+} ngx_stream_dogstatsd_stat_t;
+
+typedef struct {
+    ngx_flag_t                    off;
+    ngx_udp_endpoint_t           *endpoint;
+    ngx_uint_t                    sample_rate;
+    ngx_array_t                  *stats;
+
+    ngx_stream_complex_value_t   *session_key;
+    ngx_stream_complex_value_t   *session_tags;
+} ngx_stream_dogstatsd_conf_t;
+
+
+static void *ngx_stream_dogstatsd_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_dogstatsd_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_dogstatsd_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
+static char *ngx_stream_dogstatsd_set_server(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_dogstatsd_set_session_metrics(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_stream_dogstatsd_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_stream_dogstatsd_commands[] = {
+
+    { ngx_string("dogstatsd_server"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_dogstatsd_set_server,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dogstatsd_sample_rate"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dogstatsd_conf_t, sample_rate),
+      NULL },
+
+    { ngx_string("dogstatsd_count"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+      ngx_stream_dogstatsd_add_stat,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      STATSD_TYPE_COUNTER,
+      NULL },
+
+    { ngx_string("dogstatsd_timing"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+      ngx_stream_dogstatsd_add_stat,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      STATSD_TYPE_TIMING,
+      NULL },
+
+    { ngx_string("dogstatsd_gauge"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
+      ngx_stream_dogstatsd_add_stat,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      STATSD_TYPE_GAUGE,
+      NULL },
+
+    { ngx_string("dogstatsd_session_metrics"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_dogstatsd_set_session_metrics,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_dogstatsd_module_ctx = {
+    NULL,                                     /* preconfiguration */
+    ngx_stream_dogstatsd_init,                /* postconfiguration */
+
+    ngx_stream_dogstatsd_create_main_conf,    /* create main configuration */
+    NULL,                                     /* init main configuration */
+
+    ngx_stream_dogstatsd_create_srv_conf,     /* create server configuration */
+    ngx_stream_dogstatsd_merge_srv_conf       /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_dogstatsd_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_dogstatsd_module_ctx,         /* module context */
+    ngx_stream_dogstatsd_commands,            /* module directives */
+    NGX_STREAM_MODULE,                        /* module type */
+    NULL,                                     /* init master */
+    NULL,                                     /* init module */
+    NULL,                                     /* init process */
+    NULL,                                     /* init thread */
+    NULL,                                     /* exit thread */
+    NULL,                                     /* exit process */
+    NULL,                                     /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t
+ngx_stream_dogstatsd_get_value(ngx_stream_session_t *s,
+    ngx_stream_complex_value_t *cv, ngx_str_t v)
+{
+    ngx_str_t  val;
+
+    if (cv == NULL) {
+        return v;
+    }
+
+    if (ngx_stream_complex_value(s, cv, &val) != NGX_OK) {
+        return (ngx_str_t) ngx_null_string;
+    }
+
+    return val;
+}
+
+static void
+ngx_stream_dogstatsd_line(ngx_udp_endpoint_t *e, ngx_uint_t type, ngx_str_t *key,
+    ngx_str_t *suffix, ngx_str_t *tags, int64_t value, ngx_uint_t rate)
+{
+    u_char      line[STATSD_MAX_STR], *p;
+    const char *metric_type;
+
+    if (type == STATSD_TYPE_COUNTER) {
+        metric_type = "c";
+    } else if (type == STATSD_TYPE_TIMING) {
+        metric_type = "ms";
+    } else {
+        metric_type = "g";
+    }
+
+    p = ngx_dogstatsd_format_line(line, key, suffix, value, metric_type,
+                                  rate * (STATSD_RATE_SCALE / 100), tags);
+
+    ngx_dogstatsd_buffer_line(e, line, p - line);
+}
+
+/*
+ * Sends the duration, upstream connect time and bytes of the session, read
+ * from the session rather than formatted by variables and parsed back.
+ */
+static void
+ngx_stream_dogstatsd_session(ngx_stream_session_t *s,
+    ngx_stream_dogstatsd_conf_t *dscf, ngx_uint_t rate)
+{
+    ngx_str_t                     key, tags, suffix;
+    ngx_msec_int_t                ms;
+    ngx_time_t                   *tp;
+    ngx_stream_upstream_state_t  *state;
+
+    if (ngx_stream_complex_value(s, dscf->session_key, &key) != NGX_OK
+        || key.len == 0)
+    {
+        return;
+    }
+
+    ngx_escape_dogstatsd_key(key.data, key.data, key.len);
+
+    if (dscf->session_tags == NULL) {
+        ngx_str_null(&tags);
+
+    } else if (ngx_stream_complex_value(s, dscf->session_tags, &tags) != NGX_OK) {
+        return;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - s->start_sec) * 1000 + (tp->msec - s->start_msec));
+
+    ngx_str_set(&suffix, ".session_time");
+    ngx_stream_dogstatsd_line(dscf->endpoint, STATSD_TYPE_TIMING, &key, &suffix,
+                              &tags, (int64_t) ngx_max(ms, 0) * STATSD_VALUE_SCALE, rate);
+
+    if (s->upstream_states && s->upstream_states->nelts) {
+        state = s->upstream_states->elts;
+        state = &state[s->upstream_states->nelts - 1];
+
+        if (state->connect_time != (ngx_msec_t) -1) {
+            ngx_str_set(&suffix, ".upstream_connect_time");
+            ngx_stream_dogstatsd_line(dscf->endpoint, STATSD_TYPE_TIMING, &key,
+                                      &suffix, &tags,
+                                      (int64_t) state->connect_time * STATSD_VALUE_SCALE, rate);
+        }
+    }
+
+    if (s->connection->sent) {
+        ngx_str_set(&suffix, ".bytes_sent");
+        ngx_stream_dogstatsd_line(dscf->endpoint, STATSD_TYPE_COUNTER, &key, &suffix,
+                                  &tags, (int64_t) s->connection->sent * STATSD_VALUE_SCALE, rate);
+    }
+
+    if (s->received) {
+        ngx_str_set(&suffix, ".bytes_received");
+        ngx_stream_dogstatsd_line(dscf->endpoint, STATSD_TYPE_COUNTER, &key, &suffix,
+                                  &tags, (int64_t) s->received * STATSD_VALUE_SCALE, rate);
+    }
+}
+
+static ngx_int_t
+ngx_stream_dogstatsd_handler(ngx_stream_session_t *s)
+{
+    int64_t                       n;
+    ngx_str_t                     key, tags, value, suffix;
+    ngx_uint_t                    i, rate, start;
+    ngx_stream_dogstatsd_conf_t  *dscf;
+    ngx_stream_dogstatsd_stat_t  *stat;
+
+    dscf = ngx_stream_get_module_srv_conf(s, ngx_stream_dogstatsd_module);
+
+    if (dscf->off == 1 || dscf->endpoint == NULL) {
+        return NGX_OK;
+    }
+
+    start = ngx_dogstatsd_clock();
+
+    rate = dscf->sample_rate;
+
+    // Use a random distribution to sample at sample rate.
+    if (rate < 100 && (ngx_uint_t) (ngx_random() % 100) >= rate) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "dogstatsd: skipping sample");
+        ngx_dogstatsd_stats.sampled_out += dscf->stats->nelts;
+        ngx_dogstatsd_stats.handler_time += ngx_dogstatsd_clock() - start;
+        return NGX_OK;
+    }
+
+    ngx_str_null(&suffix);
+
+    stat = dscf->stats->elts;
+    for (i = 0; i < dscf->stats->nelts; i++) {
+
+        key = ngx_stream_dogstatsd_get_value(s, stat[i].ckey, stat[i].key);
+        ngx_escape_dogstatsd_key(key.data, key.data, key.len);
+
+        tags = ngx_stream_dogstatsd_get_value(s, stat[i].ctags, stat[i].tags);
+
+        if (stat[i].cvalid) {
+            if (ngx_stream_complex_value(s, stat[i].cvalid, &value) != NGX_OK
+                || value.len == 0)
+            {
+                continue;
+            }
+
+        } else if (!stat[i].valid) {
+            continue;
+        }
+
+        if (stat[i].cmetric == NULL) {
+            n = stat[i].metric;
+
+        } else if (ngx_stream_complex_value(s, stat[i].cmetric, &value) == NGX_OK) {
+            n = ngx_dogstatsd_metric_value(&value, stat[i].type == STATSD_TYPE_TIMING);
+
+        } else {
+            n = STATSD_VALUE_INVALID;
+        }
+
+        // Do not log if key or value is invalid, counters can't be 0 and times
+        // can't be negative
+        if (key.len == 0 || n == STATSD_VALUE_INVALID
+            || (stat[i].type == STATSD_TYPE_COUNTER && n == 0)
+            || (stat[i].type == STATSD_TYPE_TIMING && n < 0))
+        {
+            continue;
+        }
+
+        ngx_stream_dogstatsd_line(dscf->endpoint, stat[i].type, &key, &suffix,
+                                  &tags, n, rate);
+    }
+
+    if (dscf->session_key) {
+        ngx_stream_dogstatsd_session(s, dscf, rate);
+    }
+
+    /* the lines of a session go in as few datagrams as possible */
+    ngx_dogstatsd_buffer_flush(dscf->endpoint);
+
+    ngx_dogstatsd_stats.handler_time += ngx_dogstatsd_clock() - start;
+
+    return NGX_OK;
+}
+
+static void *
+ngx_stream_dogstatsd_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_dogstatsd_main_conf_t  *dmcf;
+
+    dmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_dogstatsd_main_conf_t));
+    if (dmcf == NULL) {
+        return NULL;
+    }
+
+    return dmcf;
+}
+
+static void *
+ngx_stream_dogstatsd_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_dogstatsd_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_dogstatsd_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->stats = NULL;
+     */
+
+    conf->off = NGX_CONF_UNSET;
+    conf->endpoint = NGX_CONF_UNSET_PTR;
+    conf->sample_rate = NGX_CONF_UNSET_UINT;
+    conf->session_key = NGX_CONF_UNSET_PTR;
+    conf->session_tags = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+static char *
+ngx_stream_dogstatsd_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_dogstatsd_conf_t *prev = parent;
+    ngx_stream_dogstatsd_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->endpoint, prev->endpoint, NULL);
+    ngx_conf_merge_value(conf->off, prev->off, 1);
+    ngx_conf_merge_uint_value(conf->sample_rate, prev->sample_rate, 100);
+
+    if (conf->sample_rate > 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"dogstatsd_sample_rate\" must be at most 100");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->session_key == NGX_CONF_UNSET_PTR) {
+        conf->session_key = (prev->session_key == NGX_CONF_UNSET_PTR)
+                            ? NULL : prev->session_key;
+        conf->session_tags = (prev->session_tags == NGX_CONF_UNSET_PTR)
+                             ? NULL : prev->session_tags;
+    }
+
+    if (conf->stats == NULL) {
+        conf->stats = ngx_array_create(cf->pool, 1, sizeof(ngx_stream_dogstatsd_stat_t));
+        if (conf->stats == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_dogstatsd_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_dogstatsd_conf_t       *dscf = conf;
+    ngx_stream_dogstatsd_main_conf_t  *dmcf;
+    ngx_str_t                         *value;
+    ngx_url_t                          u;
+    ngx_flag_t                         file;
+    ngx_udp_endpoint_t               **ep;
+
+    if (dscf->endpoint != NGX_CONF_UNSET_PTR || dscf->off != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        dscf->off = 1;
+        return NGX_CONF_OK;
+    }
+    dscf->off = 0;
+
+    /* Handle environment variable if present */
+    if (ngx_dogstatsd_get_env_value(cf, &value[1]) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    file = (value[1].len >= 5 && ngx_strncmp(value[1].data, "file:", 5) == 0);
+
+    if (!file) {
+        if (cf->args->nelts > 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        u.url = value[1];
+        u.default_port = STATSD_DEFAULT_PORT;
+        u.no_resolve = 0;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V: %s", &u.host, u.err);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    dmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_dogstatsd_module);
+
+    if (dmcf->endpoints == NULL) {
+        dmcf->endpoints = ngx_array_create(cf->pool, 2, sizeof(ngx_udp_endpoint_t *));
+        if (dmcf->endpoints == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    dscf->endpoint = ngx_pcalloc(cf->pool, sizeof(ngx_udp_endpoint_t));
+    if (dscf->endpoint == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ep = ngx_array_push(dmcf->endpoints);
+    if (ep == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *ep = dscf->endpoint;
+
+    if (file) {
+        return ngx_dogstatsd_set_file(cf, dscf->endpoint, &value[1],
+                                      cf->args->nelts > 2 ? &value[2] : NULL);
+    }
+
+    dscf->endpoint->peer_addr = u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_stream_dogstatsd_compile_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_stream_complex_value_t *cv)
+{
+    ngx_stream_compile_complex_value_t  ccv;
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = cv;
+
+    return ngx_stream_compile_complex_value(&ccv);
+}
+
+/*
+ * Compiles a directive argument, returns NULL in "cv" if it has no variables.
+ */
+static ngx_int_t
+ngx_stream_dogstatsd_compile(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_stream_complex_value_t **cv)
+{
+    ngx_stream_complex_value_t  c;
+
+    if (ngx_stream_dogstatsd_compile_value(cf, value, &c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (c.lengths == NULL) {
+        *cv = NULL;
+        return NGX_OK;
+    }
+
+    *cv = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+    if (*cv == NULL) {
+        return NGX_ERROR;
+    }
+
+    **cv = c;
+
+    return NGX_OK;
+}
+
+static char *
+ngx_stream_dogstatsd_add_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_dogstatsd_conf_t  *dscf = conf;
+
+    int64_t                       n;
+    ngx_str_t                    *value;
+    ngx_stream_dogstatsd_stat_t  *stat;
+
+    value = cf->args->elts;
+
+    if (dscf->stats == NULL) {
+        dscf->stats = ngx_array_create(cf->pool, 4, sizeof(ngx_stream_dogstatsd_stat_t));
+        if (dscf->stats == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    stat = ngx_array_push(dscf->stats);
+    if (stat == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(stat, sizeof(ngx_stream_dogstatsd_stat_t));
+
+    stat->type = cmd->offset;
+    stat->valid = 1;
+
+    if (ngx_stream_dogstatsd_compile(cf, &value[1], &stat->ckey) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    stat->key = value[1];
+
+    if (ngx_stream_dogstatsd_compile(cf, &value[2], &stat->cmetric) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (stat->cmetric == NULL) {
+        n = ngx_dogstatsd_metric_value(&value[2], stat->type == STATSD_TYPE_TIMING);
+        if (n == STATSD_VALUE_INVALID || (stat->type == STATSD_TYPE_TIMING && n < 0)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        stat->metric = n;
+    }
+
+    if (cf->args->nelts > 3) {
+        if (ngx_stream_dogstatsd_compile(cf, &value[3], &stat->ctags) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        stat->tags = value[3];
+    }
+
+    if (cf->args->nelts > 4) {
+        if (ngx_stream_dogstatsd_compile(cf, &value[4], &stat->cvalid) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        stat->valid = (value[4].len > 0);
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_dogstatsd_set_session_metrics(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_dogstatsd_conf_t  *dscf = conf;
+
+    ngx_str_t                    *value;
+
+    if (dscf->session_key != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    dscf->session_key = NULL;
+    dscf->session_tags = NULL;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    dscf->session_key = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+    if (dscf->session_key == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_stream_dogstatsd_compile_value(cf, &value[1], dscf->session_key) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts > 2) {
+        dscf->session_tags = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+        if (dscf->session_tags == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_stream_dogstatsd_compile_value(cf, &value[2], dscf->session_tags)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_stream_dogstatsd_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                         i;
+    ngx_udp_endpoint_t               **e;
+    ngx_stream_handler_pt             *h;
+    ngx_stream_core_main_conf_t       *cmcf;
+    ngx_stream_dogstatsd_main_conf_t  *dmcf;
+
+    dmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_dogstatsd_module);
+
+    if (dmcf->endpoints == NULL) {
+        return NGX_OK;
+    }
+
+    e = dmcf->endpoints->elts;
+    for (i = 0; i < dmcf->endpoints->nelts; i++) {
+        if (ngx_dogstatsd_init_endpoint(cf, e[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_dogstatsd_handler;
+
+    return NGX_OK;
+}